@@ -42,9 +42,28 @@
 #include <linux/acpi.h>
 #include <linux/of_device.h>
 #include <linux/spinlock.h>
+#include <linux/atomic.h>
 #include <linux/spi/spi.h>
 #include <linux/regmap.h>
+#include <linux/gpio/consumer.h>
+#include <linux/delay.h>
+#include <linux/pm_runtime.h>
+#include <linux/debugfs.h>
+#include <linux/uaccess.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mutex.h>
+#include <linux/list.h>
+#include <linux/wait.h>
+#include <linux/ktime.h>
+#include <linux/seq_file.h>
+#include <linux/rtnetlink.h>
+#include <linux/skbuff.h>
+#include <linux/random.h>
+#include <linux/unaligned.h>
+#include <linux/bottom_half.h>
 #include <net/mac802154.h>
+#include <kunit/static_stub.h>
 
 /*------------------------------ LoRa Functions ------------------------------*/
 
@@ -107,6 +126,7 @@ MODULE_PARM_DESC(rx_timeout, "RX time-out value as number of symbols");
 #define SX127X_REG_HOP_PERIOD			0x24
 #define SX127X_REG_FIFO_RX_BYTE_ADDR		0x25
 #define SX127X_REG_MODEM_CONFIG3		0x26
+#define SX127X_REG_PPM_CORRECTION		0x27
 #define SX127X_REG_FEI_MSB			0x28
 #define SX127X_REG_FEI_MID			0x29
 #define SX127X_REG_FEI_LSB			0x2A
@@ -159,22 +179,231 @@ MODULE_PARM_DESC(rx_timeout, "RX time-out value as number of symbols");
 /* SX127X's RX/TX FIFO base address */
 #define SX127X_FIFO_RX_BASE_ADDRESS		0x00
 #define SX127X_FIFO_TX_BASE_ADDRESS		0x80
+/* The FIFO is shared by RX and TX, so either of them has half of it. */
+#define SX127X_MAX_PAYLOAD_LEN			0x80
+
+/* LoRa modulation parameters which decide the time-on-air of a packet. */
+struct sx127X_lora_mod {
+	u8 sf;			/* Spreading factor as 2^sf chips / symbol */
+	u32 bw;			/* RF bandwidth in Hz */
+	u8 cr;			/* ex: 0x45 represents cr=4/5 */
+	u32 preamble;		/* Preamble length in symbols */
+	bool crc;		/* Payload CRC is on or not */
+	bool implicit;		/* Implicit header mode or not */
+	bool ldro;		/* Low data rate optimization or not */
+};
+
+/* The metadata of the last received frame. */
+struct sx1278_rx_meta {
+	ktime_t tstamp;		/* Estimated end of the frame in real time */
+	u32 toa;		/* Time-on-air in us */
+	s32 rssi;		/* RSSI in dbm */
+	s8 snr;			/* SNR in 0.25 db */
+	s32 fei;		/* Frequency error in Hz */
+	u8 lqi;
+	u8 len;
+};
+
+/* The payload streamed from the RX FIFO while the frame is still on air */
+struct sx1278_rx_ct {
+	struct sk_buff *skb;	/* Allocated with the header's length */
+	u8 len;			/* Payload length from the header */
+	u8 got;			/* Bytes read into the transport's FIFO buffer */
+	bool active;
+	bool skip;		/* Addressed elsewhere, the rest is not read */
+};
+
+struct sx1278_cap;
+struct sx1278_xfer;
+struct sx1278_rr;
+
+/* An available channel and the channel occupancy of the last scan. */
+struct sx1278_chan {
+	u8 page;
+	u8 channel;
+	u32 frq;		/* RF frequency in Hz */
+	u32 frf;		/* FRF registers' value of the frequency */
+	u32 bw;			/* RF bandwidth in Hz, 0 for the current one */
+	s32 rssi;		/* Average RSSI in dbm */
+	s32 peak;		/* Maximum RSSI in dbm */
+	bool scanned;
+};
+
+/* The settings of a device from DT or the module parameters. */
+struct sx1278_config {
+	u32 xosc;		/* Crystal oscillator frequency in Hz */
+	u32 sprf;		/* Spreading factor in chips / symbol */
+	u32 rx_timeout;		/* RX time-out as number of symbols */
+	u32 carrier;		/* Center carrier frequency in Hz */
+	u32 bw;			/* RF bandwidth in Hz */
+	u8 ch_min;
+	u8 ch_max;
+	/* The power amplifier is wired out through PA_BOOST or RFO pin. */
+	bool pa_boost;
+	bool afc;
+	bool auto_channel;
+	u8 tdma_role;
+	u8 tdma_slots;
+	u8 tdma_slot;
+	u32 duty_window;	/* Duty cycle observation window in s */
+};
+
+/* The EU sub-bands with duty cycle limits */
+#define SX1278_DC_BANDS		7
+
+/* The airtime token bucket of a sub-band. */
+struct sx1278_dc {
+	s64 tokens;		/* Remaining airtime in us */
+	ktime_t last;		/* Time of the last refill */
+	u32 deferred;		/* Frames deferred for the budget */
+	bool deferring;
+};
+
+/* The time slotted MAC state. */
+struct sx1278_tdma {
+	u8 role;
+	u8 n_slots;		/* Data slots in a superframe */
+	u8 slot;		/* Own data slot from 1 */
+	u8 seq;			/* Beacon sequence number */
+	u32 slot_us;		/* Slot length in us */
+	ktime_t epoch;		/* Start of the current superframe */
+	bool synced;
+	bool beacon_tx;
+};
+
+/* The differences between the SX1276/77/78/79 chips. */
+struct sx1278_variant {
+	const char *name;
+	u32 frq_min;		/* Minimal RF frequency in Hz */
+	u32 frq_max;		/* Maximum RF frequency in Hz */
+	u32 sprf_max;		/* Maximum spreading factor in chips / symbol */
+};
+
+/*
+ * The radio is owned by one action at a time.  The owner is in the low bits of
+ * the state word and changes by cmpxchg only from the expected owner, so RX
+ * and TX hand over the radio without a lock.
+ */
+#define SX1278_ST_IDLE		0x0	/* Standby, nothing in flight */
+#define SX1278_ST_RX_ARMED	0x1	/* Single reception started */
+#define SX1278_ST_TX_LOADING	0x2	/* Writing the frame into TX FIFO */
+#define SX1278_ST_TX_ACTIVE	0x3	/* Transmitting the frame */
+#define SX1278_ST_OWNER		0x3
+/* The queued frame is in the TX FIFO already. */
+#define SX1278_ST_TX_LOADED	BIT(2)
+
+/*
+ * The configuration requests from mac802154 and debugfs wait for an idle point
+ * of the state machine, which applies the queued ones in one batch.
+ */
+#define SX1278_REQ_CHANNEL	BIT(0)	/* Tune to req_chan */
+#define SX1278_REQ_TXPOWER	BIT(1)	/* Set the TX power to req_dbm */
+#define SX1278_REQ_ED		BIT(2)	/* Sample the energy into req_rssi */
+#define SX1278_REQ_SCAN		BIT(3)	/* Scan the energy of all channels */
+#define SX1278_REQ_AFC		BIT(4)	/* Retune to the AFC's correction */
+
+/*
+ * The radios on one SPI controller are polled by a single timer and work, so
+ * their transfers do not interleave at random.  Each pass reads the status of
+ * all the radios first, then serves the urgent ones before the bulk FIFO reads.
+ */
+struct sx1278_bus {
+	struct list_head node;		/* In sx1278_buses */
+	struct spi_controller *ctlr;
+	struct list_head phys;		/* The radios on the controller */
+	/* Serializes the passes with the radios pausing and leaving */
+	struct mutex lock;
+	struct timer_list timer;
+	struct work_struct work;
+	/* Bus utilization */
+	u64 passes;
+	ktime_t window;			/* Start of the utilization window */
+	s64 busy_ns;			/* Time in the passes of the window */
+	s64 max_pass_ns;
+	u32 util;			/* Permille of the last window */
+};
 
 struct sx1278_phy {
 	struct ieee802154_hw *hw;
 	struct regmap *map;
+	struct dentry *debugfs;
+	const struct sx1278_variant *variant;
+	struct gpio_desc *reset;
+	struct sx1278_xfer *xfer;
+	struct sx1278_rr *rr;
+	struct sx1278_config cfg;
 
 	bool suspended;
+	bool running;
+	bool promiscuous;
+	/* Radio state snapshot for suspend and resume. */
+	bool configured;
+	bool pm_valid;
+	bool pm_asleep;
+	u8 pm_page;
+	u8 pm_channel;
+	u8 pm_regs[SX127X_MAX_REG + 1];
 	u8 opmode;
-	struct timer_list timer;
-	struct work_struct irqwork;
-	/* Lock the RX and TX actions. */
-	spinlock_t buf_lock;
+	/* Polled by the pass of the SPI bus */
+	struct sx1278_bus *bus;
+	struct list_head bus_node;
+	int poll_flags;
+	int poll_state;
+	ktime_t poll_time;	/* Monotonic, which schedules the state machine */
+	/* The radio ownership and TX FIFO state, see SX1278_ST_*. */
+	atomic_t state;
+	/* The frame taken from the TX queues until it is sent. */
 	struct sk_buff *tx_buf;
 	u8 tx_delay;
-	bool one_to_be_sent;
-	bool post_tx_done;
-	bool is_busy;
+	/* Airtime of the current TX burst in us */
+	u32 burst_us;
+	/* Modulation cache and timestamps for the time-on-air correction. */
+	struct sx127X_lora_mod mod;
+	struct sx1278_rx_meta rx_meta;
+	struct sx1278_rx_ct rx_ct;
+	/* Fixed packet length of implicit header mode, 0 for explicit. */
+	u8 implicit_len;
+	ktime_t last_poll;
+	ktime_t rx_done;	/* Monotonic estimate of the end of the frame */
+	ktime_t tx_start;
+	/* Available channels with their precalculated FRF values. */
+	struct sx1278_chan *chans;
+	u16 n_chans;
+	struct sx1278_chan *chan;
+	/* Nominal RF frequency and the automatic frequency correction. */
+	u32 frq;
+	s32 afc_target;
+	s32 afc_offset;
+	s32 afc_frf;
+	/* Time of the last channel scan. */
+	ktime_t scan_time;
+	struct sx1278_tdma tdma;
+	struct sx1278_dc dc[SX1278_DC_BANDS];
+	/* Address filter and the auto ACK with retransmission. */
+	u16 pan_id;
+	u16 short_addr;
+	u64 ext_addr;
+	bool pan_coord;
+	u8 frame_retries;
+	u8 retries;
+	bool ack_wait;
+	bool ack_tx;
+	u8 ack_seq;
+	ktime_t ack_deadline;
+	/* Frames dropped by the address filter */
+	u32 filtered;
+	/* Configuration requests applied at the next idle point */
+	spinlock_t req_lock;
+	wait_queue_head_t req_wq;
+	u8 req_pending;
+	u8 req_busy;
+	struct sx1278_chan *req_chan;
+	s32 req_dbm;
+	s32 req_rssi;
+	/* Monitor mode packet capture. */
+	spinlock_t cap_lock;
+	wait_queue_head_t cap_wq;
+	struct sx1278_cap *cap;
 };
 
 /**
@@ -263,34 +492,54 @@ sx127X_get_state(struct regmap *map)
 }
 
 /**
- * sx127X_set_lorafrq - Set RF frequency
- * @map:	the device as a regmap to communicate with
- * @fr:		RF frequency going to be assigned in Hz
+ * sx127X_lorafrq2frf - Convert RF frequency to the FRF registers' value
+ * @fr:		RF frequency in Hz
+ * @f_xosc:	the crystal oscillator frequency in Hz
+ *
+ * Return:	the 24 bits FRF value
  */
-void
-sx127X_set_lorafrq(struct regmap *map, u32 fr)
+u32
+sx127X_lorafrq2frf(u32 fr, u32 f_xosc)
 {
 	u64 frt;
-	u8 buf[3];
-	s8 i;
-	u32 f_xosc;
-	u8 op_mode;
 
-#ifdef CONFIG_OF
-	/* Set the LoRa module's crystal oscillator's clock if OF is defined. */
-	struct device_node *of_node = (regmap_get_device(map))->of_node;
+	/* Round to the nearest FRF step of f_xosc / 2^19. */
+	frt = (uint64_t)fr * (uint64_t)__POW_2_19 + f_xosc / 2;
+	do_div(frt, f_xosc);
 
-	if (of_property_read_u32(of_node, "clock-frequency", &f_xosc))
-		f_xosc = xosc_frq;
-#else
-	f_xosc = xosc_frq;
-#endif
+	return (u32)frt;
+}
 
-	frt = (uint64_t)fr * (uint64_t)__POW_2_19;
-	do_div(frt, f_xosc);
+/**
+ * sx127X_hop_lorafrf - Change RF frequency without going through sleep state
+ * @map:	the device as a regmap to communicate with
+ * @frf:	the 24 bits FRF value going to be assigned
+ *
+ * The device must be in standby state and the frequency must be in the same
+ * low / high frequency band.  The new frequency is taken at the next RX / TX.
+ */
+void
+sx127X_hop_lorafrf(struct regmap *map, u32 frf)
+{
+	u8 buf[3];
+
+	buf[0] = (frf >> 16) & 0xFF;
+	buf[1] = (frf >> 8) & 0xFF;
+	buf[2] = frf & 0xFF;
+	regmap_raw_write(map, SX127X_REG_FRF_MSB, buf, 3);
+}
 
-	for (i = 2; i >= 0; i--)
-		buf[i] = do_div(frt, 256);
+/**
+ * sx127X_set_lorafrf - Set RF frequency with the FRF registers' value
+ * @map:	the device as a regmap to communicate with
+ * @frf:	the 24 bits FRF value going to be assigned
+ * @fr:		the RF frequency in Hz which decides the low / high frequency
+ *		band
+ */
+void
+sx127X_set_lorafrf(struct regmap *map, u32 frf, u32 fr)
+{
+	u8 op_mode;
 
 	op_mode = sx127X_get_mode(map);
 	/* Set Low/High frequency bit. */
@@ -299,52 +548,82 @@ sx127X_set_lorafrq(struct regmap *map, u32 fr)
 	else if (fr <= 525000000)
 		op_mode |= 0x8;
 	sx127X_set_state(map, SX127X_SLEEP_MODE);
-	regmap_raw_write(map, SX127X_REG_FRF_MSB, buf, 3);
+	sx127X_hop_lorafrf(map, frf);
 	sx127X_set_mode(map, op_mode);
 }
 
+/**
+ * sx127X_set_lorafrq - Set RF frequency
+ * @map:	the device as a regmap to communicate with
+ * @fr:		RF frequency going to be assigned in Hz
+ * @f_xosc:	the crystal oscillator frequency in Hz
+ */
+void
+sx127X_set_lorafrq(struct regmap *map, u32 fr, u32 f_xosc)
+{
+	sx127X_set_lorafrf(map, sx127X_lorafrq2frf(fr, f_xosc), fr);
+}
+
 /**
  * sx127X_get_lorafrq - Get RF frequency
  * @map:	the device as a regmap to communicate with
+ * @f_xosc:	the crystal oscillator frequency in Hz
  *
  * Return:	RF frequency in Hz
  */
 u32
-sx127X_get_lorafrq(struct regmap *map)
+sx127X_get_lorafrq(struct regmap *map, u32 f_xosc)
 {
 	u64 frt = 0;
 	u8 buf[3];
 	u8 i;
 	int status;
 	u32 fr;
-	u32 f_xosc;
-
-#ifdef CONFIG_OF
-	/* Set the LoRa module's crystal oscillator's clock if OF is defined. */
-	struct device_node *of_node = (regmap_get_device(map))->of_node;
-
-	if (of_property_read_u32(of_node, "clock-frequency", &f_xosc))
-		f_xosc = xosc_frq;
-#else
-	f_xosc = xosc_frq;
-#endif
 
 	status = regmap_raw_read(map, SX127X_REG_FRF_MSB, buf, 3);
 	if (status < 0)
-		return 0.0;
+		return 0;
 
 	for (i = 0; i <= 2; i++)
 		frt = frt * 256 + buf[i];
 
-	fr =  frt * f_xosc / __POW_2_19;
+	/* 24 bits FRF times 32 bits f_xosc fits in u64, round it to Hz. */
+	fr = (frt * f_xosc + __POW_2_19 / 2) >> 19;
 
 	return fr;
 }
 
+/**
+ * sx127X_set_loraocp - Set the over current protection of the power amplifier
+ * @map:	the device as a regmap to communicate with
+ * @ma:		the maximum current in mA, 0 for turning off the protection
+ */
+void
+sx127X_set_loraocp(struct regmap *map, u32 ma)
+{
+	u8 ocp;
+	u8 trim;
+
+	if (ma == 0) {
+		ocp = 0x00;
+	} else {
+		/* Imax = 45 + 5 * trim or -30 + 10 * trim in mA */
+		ma = clamp_t(u32, ma, 45, 240);
+		trim = (ma <= 120) ? (ma - 45) / 5 : (ma + 30) / 10;
+		ocp = 0x20 | trim;
+	}
+
+	regmap_raw_write(map, SX127X_REG_OCP, &ocp, 1);
+}
+
 /**
  * sx127X_set_lorapower - Set RF output power
  * @map:	the device as a regmap to communicate with
  * @pout:	RF output power going to be assigned in dbm
+ *
+ * The output pin follows the PA select bit which is set by sx127X_set_boost
+ * according to the board's wiring.  PA_BOOST pin goes up to +20 dbm with the
+ * high power PA_DAC setting, RFO pin goes up to +15 dbm.
  */
 void
 sx127X_set_lorapower(struct regmap *map, s32 pout)
@@ -352,25 +631,40 @@ sx127X_set_lorapower(struct regmap *map, s32 pout)
 	u8 pacf;
 	u8 boost;
 	u8 output_power;
+	u8 padac;
 	s32 pmax;
 
-	if (pout > 14) {
-		/* Pout > 14dbm */
-		boost = 1;
+	regmap_raw_read(map, SX127X_REG_PA_CONFIG, &pacf, 1);
+	boost = (pacf & 0x80) >> 7;
+	padac = 0x84;
+
+	if (boost) {
+		/* PA_BOOST: 2dbm <= Pout <= 17dbm, or 20dbm with PA_DAC */
 		pmax = 7;
-		output_power = pout - 2;
+		if (pout >= 20) {
+			padac = 0x87;
+			output_power = 15;
+		} else {
+			/* 18 and 19dbm are not settable, so stay under them. */
+			pout = clamp_t(s32, pout, 2, 17);
+			output_power = pout - 2;
+		}
 	} else if (pout < 0) {
-		/* Pout < 0dbm */
-		boost = 0;
+		/* RFO: -3dbm <= Pout < 0dbm */
 		pmax = 2;
+		pout = (pout < -3) ? -3 : pout;
 		output_power = 3 + pout;
 	} else {
-		/* 0dbm <= Pout <= 14dbm */
-		boost = 0;
+		/* RFO: 0dbm <= Pout <= 15dbm */
 		pmax = 7;
+		pout = (pout > 15) ? 15 : pout;
 		output_power = pout;
 	}
 
+	/* Over current protection must allow the current of +20dbm. */
+	sx127X_set_loraocp(map, (padac == 0x87) ? 140 : 100);
+	regmap_raw_write(map, SX127X_REG_PA_DAC, &padac, 1);
+
 	pacf = (boost << 7) | (pmax << 4) | (output_power);
 	regmap_raw_write(map, SX127X_REG_PA_CONFIG, &pacf, 1);
 }
@@ -385,6 +679,7 @@ s32
 sx127X_get_lorapower(struct regmap *map)
 {
 	u8 pac;
+	u8 padac;
 	u8 boost;
 	s32 output_power;
 	s32 pmax;
@@ -394,7 +689,9 @@ sx127X_get_lorapower(struct regmap *map)
 	boost = (pac & 0x80) >> 7;
 	output_power = pac & 0x0F;
 	if (boost) {
-		pout = 2 + output_power;
+		regmap_raw_read(map, SX127X_REG_PA_DAC, &padac, 1);
+		pout = ((padac & 0x07) == 0x07) ? 5 + output_power :
+						  2 + output_power;
 	} else {
 		/* Power max should be pmax/10.  It is 10 times for now. */
 		pmax = (108 + 6 * ((pac & 0x70) >> 4));
@@ -420,12 +717,13 @@ sx127X_get_lorapower(struct regmap *map)
  */
 #define sx127X_mbm2dbm(mbm)	(mbm / 100)
 
-s8 lna_gain[] = {
+/* LNA gain G1 to G6 in db relative to the maximum gain */
+static const s8 lna_gain[] = {
 	 0,
 	-6,
 	-12,
 	-24,
-	-26,
+	-36,
 	-48
 };
 
@@ -440,7 +738,7 @@ sx127X_set_loralna(struct regmap *map, s32 db)
 	u8 i, g;
 	u8 lnacf;
 
-	for (i = 0; i < 5; i++) {
+	for (i = 0; i < ARRAY_SIZE(lna_gain) - 1; i++) {
 		if (lna_gain[i] <= db)
 			break;
 	}
@@ -466,7 +764,8 @@ sx127X_get_loralna(struct regmap *map)
 
 	regmap_raw_read(map, SX127X_REG_LNA, &lnacf, 1);
 	g = (lnacf >> 5);
-	i = g - 1;
+	/* 000 and 111 are reserved. */
+	i = clamp_t(s8, g - 1, 0, ARRAY_SIZE(lna_gain) - 1);
 	db = lna_gain[i];
 
 	return db;
@@ -535,16 +834,36 @@ sx127X_clear_loraflag(struct regmap *map, u8 f)
  */
 #define sx127X_clear_loraallflag(spi)	sx127X_clear_loraflag(spi, 0xFF)
 
+/**
+ * sx127X_set_loraimplicit - Set LoRa packages with Explicit / Implicit Header
+ * @map:	the device as a regmap to communicate with
+ * @yesno:	1 / 0 for Implicit Header Mode / Explicit Header Mode
+ */
+void
+sx127X_set_loraimplicit(struct regmap *map, u8 yesno)
+{
+	u8 mcf1;
+
+	regmap_raw_read(map, SX127X_REG_MODEM_CONFIG1, &mcf1, 1);
+	mcf1 = (yesno) ? (mcf1 | 0x01) : (mcf1 & 0xFE);
+	regmap_raw_write(map, SX127X_REG_MODEM_CONFIG1, &mcf1, 1);
+}
+
 /**
  * sx127X_set_lorasprf - Set the RF modulation's spreading factor
  * @map:	the device as a regmap to communicate with
  * @c_s:	Spreading factor in chips / symbol
+ *
+ * Spreading factor 6 works only in implicit header mode with its own
+ * detection optimize and detection threshold, so they are set together.
  */
 void
 sx127X_set_lorasprf(struct regmap *map, u32 c_s)
 {
 	u8 sf;
 	u8 mcf2;
+	u8 dopt;
+	u8 dthr;
 
 	for (sf = 6; sf < 12; sf++) {
 		if (c_s == ((u32)1 << sf))
@@ -554,6 +873,15 @@ sx127X_set_lorasprf(struct regmap *map, u32 c_s)
 	regmap_raw_read(map, SX127X_REG_MODEM_CONFIG2, &mcf2, 1);
 	mcf2 = (mcf2 & 0x0F) | (sf << 4);
 	regmap_raw_write(map, SX127X_REG_MODEM_CONFIG2, &mcf2, 1);
+
+	regmap_raw_read(map, SX127X_REG_DETECT_OPTIMIZE, &dopt, 1);
+	dopt = (dopt & 0xF8) | ((sf == 6) ? 0x05 : 0x03);
+	regmap_raw_write(map, SX127X_REG_DETECT_OPTIMIZE, &dopt, 1);
+
+	dthr = (sf == 6) ? 0x0C : 0x0A;
+	regmap_raw_write(map, SX127X_REG_DETECTION_THRESHOLD, &dthr, 1);
+
+	sx127X_set_loraimplicit(map, (sf == 6) ? 1 : 0);
 }
 
 /**
@@ -588,6 +916,43 @@ const u32 hz[] = {
 	500000
 };
 
+/**
+ * sx127X_set_loraldro - Set LoRa low data rate optimization
+ * @map:	the device as a regmap to communicate with
+ * @yesno:	1 / 0 for optimize / not optimize
+ */
+void
+sx127X_set_loraldro(struct regmap *map, u8 yesno)
+{
+	u8 mcf3;
+
+	regmap_raw_read(map, SX127X_REG_MODEM_CONFIG3, &mcf3, 1);
+	mcf3 = (yesno) ? (mcf3 | 0x08) : (mcf3 & (~0x08));
+	regmap_raw_write(map, SX127X_REG_MODEM_CONFIG3, &mcf3, 1);
+}
+
+/**
+ * sx127X_update_loraldro - Set LoRa low data rate optimization automatically
+ * @map:	the device as a regmap to communicate with
+ *
+ * The low data rate optimization is mandated when the symbol duration exceeds
+ * 16ms, ex: SF11 and SF12 with 125kHz bandwidth.
+ */
+void
+sx127X_update_loraldro(struct regmap *map)
+{
+	u8 mcf[2];
+	u32 bw;
+	u32 tsym;
+
+	regmap_raw_read(map, SX127X_REG_MODEM_CONFIG1, mcf, 2);
+	bw = hz[min_t(u8, mcf[0] >> 4, ARRAY_SIZE(hz) - 1)];
+	/* Symbol duration in us */
+	tsym = ((u32)1 << (mcf[1] >> 4)) * 1000 / (bw / 1000);
+
+	sx127X_set_loraldro(map, (tsym > 16000) ? 1 : 0);
+}
+
 /**
  * sx127X_set_lorabw - Set RF bandwidth
  * @map:	the device as a regmap to communicate with
@@ -607,6 +972,8 @@ sx127X_set_lorabw(struct regmap *map, u32 bw)
 	regmap_raw_read(map, SX127X_REG_MODEM_CONFIG1, &mcf1, 1);
 	mcf1 = (mcf1 & 0x0F) | (i << 4);
 	regmap_raw_write(map, SX127X_REG_MODEM_CONFIG1, &mcf1, 1);
+
+	sx127X_update_loraldro(map);
 }
 
 /**
@@ -622,7 +989,8 @@ sx127X_get_lorabw(struct regmap *map)
 	u8 bw;
 
 	regmap_raw_read(map, SX127X_REG_MODEM_CONFIG1, &mcf1, 1);
-	bw = mcf1 >> 4;
+	/* The values above 500kHz are reserved. */
+	bw = min_t(u8, mcf1 >> 4, ARRAY_SIZE(hz) - 1);
 
 	return hz[bw];
 }
@@ -662,21 +1030,6 @@ sx127X_get_loracr(struct regmap *map)
 	return cr;
 }
 
-/**
- * sx127X_set_loraimplicit - Set LoRa packages with Explicit / Implicit Header
- * @map:	the device as a regmap to communicate with
- * @yesno:	1 / 0 for Implicit Header Mode / Explicit Header Mode
- */
-void
-sx127X_set_loraimplicit(struct regmap *map, u8 yesno)
-{
-	u8 mcf1;
-
-	regmap_raw_read(map, SX127X_REG_MODEM_CONFIG1, &mcf1, 1);
-	mcf1 = (yesno) ? (mcf1 | 0x01) : (mcf1 & 0xFE);
-	regmap_raw_write(map, SX127X_REG_MODEM_CONFIG1, &mcf1, 1);
-}
-
 /**
  * sx127X_set_lorarxbytetimeout - Set RX operation time-out in terms of symbols
  * @map:	the device as a regmap to communicate with
@@ -714,7 +1067,9 @@ sx127X_set_lorarxtimeout(struct regmap *map, u32 ms)
 {
 	u32 n;
 
-	n = ms * sx127X_get_lorabw(map) / (sx127X_get_lorasprf(map) * 1000);
+	/* ms * bw overflows u32 after a few seconds at 500kHz. */
+	n = div_u64((u64)ms * sx127X_get_lorabw(map),
+		    sx127X_get_lorasprf(map) * 1000);
 
 	sx127X_set_lorarxbytetimeout(map, n);
 }
@@ -749,8 +1104,8 @@ sx127X_get_lorarxtimeout(struct regmap *map)
 {
 	u32 ms;
 
-	ms = 1000 * sx127X_get_lorarxbytetimeout(map) *
-		sx127X_get_lorasprf(map) / sx127X_get_lorabw(map);
+	ms = div_u64((u64)1000 * sx127X_get_lorarxbytetimeout(map) *
+		     sx127X_get_lorasprf(map), sx127X_get_lorabw(map));
 
 	return ms;
 }
@@ -802,7 +1157,7 @@ sx127X_readloradata(struct regmap *map, u8 *buf, size_t len)
 	regmap_raw_write(map, SX127X_REG_FIFO_ADDR_PTR, &start_adr, 1);
 
 	/* Read LoRa packet payload. */
-	len = (len <= IEEE802154_MTU) ? len : IEEE802154_MTU;
+	len = (len <= SX127X_MAX_PAYLOAD_LEN) ? len : SX127X_MAX_PAYLOAD_LEN;
 	ret = regmap_raw_read(map, SX127X_REG_FIFO, buf, len);
 
 	return (ret >= 0) ? len : ret;
@@ -827,7 +1182,7 @@ sx127X_sendloradata(struct regmap *map, u8 *buf, size_t len)
 	regmap_raw_write(map, SX127X_REG_FIFO_ADDR_PTR, &base_adr, 1);
 
 	/* Write payload synchronously to fill the FIFO of the chip. */
-	blen = (len <= IEEE802154_MTU) ? len : IEEE802154_MTU;
+	blen = (len <= SX127X_MAX_PAYLOAD_LEN) ? len : SX127X_MAX_PAYLOAD_LEN;
 	regmap_raw_write(map, SX127X_REG_FIFO, buf, blen);
 
 	/* Set the FIFO payload length. */
@@ -904,6 +1259,35 @@ sx127X_get_lorarssi(struct regmap *map)
 	return dbm;
 }
 
+/**
+ * sx127X_get_lorafei - Get last LoRa packet's frequency error
+ * @map:	the device as a regmap to communicate with
+ * @f_xosc:	the crystal oscillator frequency in Hz
+ * @bw:		the RF bandwidth in Hz
+ *
+ * Return:	the last LoRa packet's frequency error in Hz
+ */
+s32
+sx127X_get_lorafei(struct regmap *map, u32 f_xosc, u32 bw)
+{
+	u8 buf[3];
+	s32 fei;
+	s64 err;
+
+	regmap_raw_read(map, SX127X_REG_FEI_MSB, buf, 3);
+
+	/* FEI is a 20 bits signed value. */
+	fei = ((buf[0] & 0x0F) << 16) | (buf[1] << 8) | buf[2];
+	if (fei & 0x80000)
+		fei -= 0x100000;
+
+	/* Ferr = FEI * 2^24 / Fxosc * BW / 500kHz */
+	err = div_s64((s64)fei * (1 << 24), f_xosc);
+	err = div_s64(err * bw, 500000);
+
+	return err;
+}
+
 /**
  * sx127X_set_lorapreamblelen - Set LoRa preamble length
  * @map:	the device as a regmap to communicate with
@@ -968,18 +1352,71 @@ sx127X_set_boost(struct regmap *map, u8 yesno)
 	regmap_raw_write(map, SX127X_REG_PA_CONFIG, &pacf, 1);
 }
 
+/**
+ * sx127X_get_loramod - Get the LoRa modulation parameters
+ * @map:	the device as a regmap to communicate with
+ * @mod:	the modulation parameters going to be filled
+ */
+void
+sx127X_get_loramod(struct regmap *map, struct sx127X_lora_mod *mod)
+{
+	u8 mcf[2];
+	u8 mcf3;
+
+	regmap_raw_read(map, SX127X_REG_MODEM_CONFIG1, mcf, 2);
+	regmap_raw_read(map, SX127X_REG_MODEM_CONFIG3, &mcf3, 1);
+
+	mod->bw = hz[min_t(u8, mcf[0] >> 4, ARRAY_SIZE(hz) - 1)];
+	mod->cr = 0x40 + ((mcf[0] & 0x0E) >> 1) + 4;
+	mod->implicit = mcf[0] & 0x01;
+	mod->sf = mcf[1] >> 4;
+	mod->crc = mcf[1] & (1 << 2);
+	mod->ldro = mcf3 & 0x08;
+	mod->preamble = sx127X_get_lorapreamblelen(map);
+}
+
+/**
+ * sx127X_lora_toa - Calculate the time-on-air of a LoRa packet
+ * @mod:	the modulation parameters
+ * @len:	the length of the packet's payload in bytes
+ *
+ * Return:	the time-on-air in us
+ */
+u32
+sx127X_lora_toa(const struct sx127X_lora_mod *mod, u8 len)
+{
+	s32 num;
+	s32 den;
+	u32 nsym;
+	u64 qsym;
+
+	if (mod->bw == 0)
+		return 0;
+
+	/* Payload symbols according to the SX1276/77/78/79 datasheet 4.1.1.7 */
+	num = 8 * len - 4 * mod->sf + 28 + 16 * mod->crc - 20 * mod->implicit;
+	den = 4 * (mod->sf - 2 * mod->ldro);
+	nsym = 8;
+	if (num > 0 && den > 0)
+		nsym += DIV_ROUND_UP(num, den) * (mod->cr & 0x0F);
+
+	/* Count in quarter symbols for the 4.25 symbols of the sync word. */
+	qsym = (u64)(mod->preamble * 4 + 17 + nsym * 4) << mod->sf;
+
+	return div_u64(qsym * USEC_PER_SEC, mod->bw * 4);
+}
+
 /**
  * sx127X_start_loramode - Start the device and set it in LoRa mode
  * @map:	the device as a regmap to communicate with
+ * @c_s:	the spreading factor in chips / symbol
+ * @rx_to:	the RX time-out value as number of symbols
  */
 void
-sx127X_start_loramode(struct regmap *map)
+sx127X_start_loramode(struct regmap *map, u32 c_s, u32 rx_to)
 {
 	u8 op_mode;
 	u8 base_adr;
-#ifdef CONFIG_OF
-	struct device_node *of_node = (regmap_get_device(map))->of_node;
-#endif
 
 	/* Get original OP Mode register. */
 	op_mode = sx127X_get_mode(map);
@@ -1009,13 +1446,11 @@ sx127X_start_loramode(struct regmap *map)
 	regmap_raw_write(map, SX127X_REG_FIFO_TX_BASE_ADDR, &base_adr, 1);
 
 	/* Set the CSS spreading factor. */
-#ifdef CONFIG_OF
-	of_property_read_u32(of_node, "spreading-factor", &sprf);
-#endif
-	sx127X_set_lorasprf(map, sprf);
+	sx127X_set_lorasprf(map, c_s);
+	sx127X_update_loraldro(map);
 
 	/* Set RX time-out value. */
-	sx127X_set_lorarxbytetimeout(map, rx_timeout);
+	sx127X_set_lorarxbytetimeout(map, rx_to);
 
 	/* Clear all of the IRQ flags. */
 	sx127X_clear_loraallflag(map);
@@ -1023,6 +1458,83 @@ sx127X_start_loramode(struct regmap *map)
 	sx127X_set_state(map, SX127X_RXSINGLE_MODE);
 }
 
+/* The configuration registers of LoRa mode in continuous address blocks. */
+static const struct {
+	u8 reg;
+	u8 len;
+} sx127X_config_blocks[] = {
+	/* FRF, PA, OCP, LNA and FIFO base addresses */
+	{ SX127X_REG_FRF_MSB,
+	  SX127X_REG_FIFO_RX_BASE_ADDR - SX127X_REG_FRF_MSB + 1 },
+	{ SX127X_REG_IRQ_FLAGS_MASK, 1 },
+	/* Modem configs, RX time-out, preamble and payload lengths */
+	{ SX127X_REG_MODEM_CONFIG1,
+	  SX127X_REG_PPM_CORRECTION - SX127X_REG_MODEM_CONFIG1 + 1 },
+	/* Detection optimize, invert IQ, detection threshold and sync word */
+	{ SX127X_REG_DETECT_OPTIMIZE,
+	  SX127X_REG_SYNC_WORD - SX127X_REG_DETECT_OPTIMIZE + 1 },
+	{ SX127X_REG_TCXO, 1 },
+	{ SX127X_REG_PA_DAC, 1 },
+};
+
+/**
+ * sx127X_save_config - Take a snapshot of the LoRa configuration registers
+ * @map:	the device as a regmap to communicate with
+ * @regs:	the register values indexed by the addresses, whose size is at
+ *		least SX127X_MAX_REG + 1
+ *
+ * Return:	0 / negtive values for success / failed
+ */
+int
+sx127X_save_config(struct regmap *map, u8 *regs)
+{
+	int i;
+	int ret;
+
+	ret = regmap_raw_read(map, SX127X_REG_OP_MODE,
+			      &regs[SX127X_REG_OP_MODE], 1);
+	for (i = 0; (ret >= 0) && (i < ARRAY_SIZE(sx127X_config_blocks)); i++)
+		ret = regmap_raw_read(map, sx127X_config_blocks[i].reg,
+				      &regs[sx127X_config_blocks[i].reg],
+				      sx127X_config_blocks[i].len);
+
+	return (ret >= 0) ? 0 : ret;
+}
+
+/**
+ * sx127X_restore_config - Write back the LoRa configuration registers
+ * @map:	the device as a regmap to communicate with
+ * @regs:	the register values taken by sx127X_save_config
+ *
+ * The device may have lost power, so it goes through sleep state to switch
+ * into LoRa mode, gets the register blocks in bursts and stays in standby.
+ *
+ * Return:	0 / negtive values for success / failed
+ */
+int
+sx127X_restore_config(struct regmap *map, const u8 *regs)
+{
+	u8 op_mode;
+	int i;
+	int ret;
+
+	/* The LoRa mode bit can be changed only in sleep state. */
+	sx127X_set_state(map, SX127X_SLEEP_MODE);
+	op_mode = (regs[SX127X_REG_OP_MODE] & 0xF8) | SX127X_SLEEP_MODE;
+	ret = regmap_raw_write(map, SX127X_REG_OP_MODE, &op_mode, 1);
+
+	for (i = 0; (ret >= 0) && (i < ARRAY_SIZE(sx127X_config_blocks)); i++)
+		ret = regmap_raw_write(map, sx127X_config_blocks[i].reg,
+				       &regs[sx127X_config_blocks[i].reg],
+				       sx127X_config_blocks[i].len);
+
+	op_mode = (op_mode & 0xF8) | SX127X_STANDBY_MODE;
+	if (ret >= 0)
+		ret = regmap_raw_write(map, SX127X_REG_OP_MODE, &op_mode, 1);
+
+	return (ret >= 0) ? 0 : ret;
+}
+
 /**
  * init_sx127x - Initial the SX127X device
  * @map:	the device as a regmap to communicate with
@@ -1052,169 +1564,2872 @@ init_sx127x(struct regmap *map)
 	}
 }
 
-/*---------------------- SX1278 IEEE 802.15.4 Functions ----------------------*/
+/*---------------------- SX1278 SPI Record and Replay ------------------------*/
 
-/* LoRa device's sensitivity in dbm. */
-#ifndef SX1278_IEEE_SENSITIVITY
-#define SX1278_IEEE_SENSITIVITY	(-148)
+/*
+ * Every SPI transaction of both regmap and the direct transport can be
+ * recorded from a live radio through the debugfs "spi_record" file, and fed
+ * back to the driver through "spi_replay" instead of the chip.  The record is
+ * a stream of a header and the transactions:
+ *
+ *   header:      "SXRR", version (le32)
+ *   transaction: time since the previous one in us (le32), address with
+ *                SX127X_SPI_WRITE for writes (u8), length (u8), the written
+ *                or read bytes
+ *
+ * The replay serves each transaction with the next recorded one of the same
+ * address and direction, at the recorded time relative to the first one.  For
+ * example, record a busy gateway and replay it as a benchmark:
+ *
+ *   cat /sys/kernel/debug/sx1278/spi0.0/spi_record > gw.sxrr
+ *   cat gw.sxrr > /sys/kernel/debug/sx1278/spi0.0/spi_replay
+ *
+ * Start recording and replaying with the interface down, so both begin with
+ * the radio initialization.
+ */
+
+#define SX1278_RR_MAGIC		"SXRR"
+#define SX1278_RR_VERSION	1
+#define SX1278_RR_HDR_LEN	8
+#define SX1278_RR_ENT_LEN	6
+
+#ifndef SX1278_RR_RING_SIZE
+#define SX1278_RR_RING_SIZE	(1 << 16)
 #endif
-static s32 sensitivity = SX1278_IEEE_SENSITIVITY;
-module_param(sensitivity, int, 0000);
-MODULE_PARM_DESC(sensitivity, "RF receiver's sensitivity");
 
-#define SX1278_IEEE_ENERGY_RANGE	(-sensitivity)
+/* The recorded transactions skipped to find the matched one at most */
+#define SX1278_RR_LOOKAHEAD	8
+
+static u32 spi_replay_kb = 16384;
+module_param(spi_replay_kb, uint, 0000);
+MODULE_PARM_DESC(spi_replay_kb, "Size limit in KiB of a SPI replay");
+
+struct sx1278_rr {
+	/* Recording */
+	spinlock_t lock;
+	wait_queue_head_t wq;
+	u8 *ring;
+	unsigned int head;
+	unsigned int tail;
+	u32 dropped;
+	ktime_t last;
+	/* Replay */
+	struct mutex replay_lock;
+	u8 *pending;
+	size_t pending_len;
+	u8 *log;
+	size_t log_len;
+	size_t pos;
+	bool replaying;
+	ktime_t start;
+	u64 ts;			/* Recorded time of the position in us */
+	u32 served;
+	u32 mismatched;
+	u32 max_late;		/* The latest served transaction in us */
+};
 
-static int
-sx1278_ieee_ed(struct ieee802154_hw *hw, u8 *level)
+/**
+ * sx1278_rr_record - Record a SPI transaction
+ * @rr:		the record and replay state
+ * @addr:	the register address, with SX127X_SPI_WRITE for writes
+ * @data:	the written or read bytes
+ * @len:	the length of the data in bytes
+ */
+static void
+sx1278_rr_record(struct sx1278_rr *rr, u8 addr, const u8 *data, size_t len)
 {
-	struct sx1278_phy *phy = hw->priv;
-	s32 rssi;
-	s32 range = SX1278_IEEE_ENERGY_RANGE - 10;
+	u8 ent[SX1278_RR_ENT_LEN];
+	unsigned int i;
+	unsigned long f;
+	ktime_t now;
 
-	dev_dbg(regmap_get_device(phy->map), "%s\n", __func__);
+	if (!READ_ONCE(rr->ring))
+		return;
 
-	/* ED: IEEE  802.15.4-2011 8.2.5 Recevier ED. */
-	rssi = sx127X_get_lorarssi(phy->map);
-	if (rssi < (sensitivity + 10))
-		*level = 0;
-	else if (rssi >= 0)
-		*level = 255;
-	else
-		*level = ((s32)255 * (rssi + range) / range) % 255;
+	len = min_t(size_t, len, U8_MAX);
+	now = ktime_get();
 
-	return 0;
-}
+	spin_lock_irqsave(&rr->lock, f);
+	if (!rr->ring) {
+		spin_unlock_irqrestore(&rr->lock, f);
+		return;
+	}
 
-#ifndef SX1278_IEEE_CHANNEL_MIN
-#define SX1278_IEEE_CHANNEL_MIN		11
+	if (SX1278_RR_RING_SIZE - (rr->head - rr->tail) <
+	    SX1278_RR_ENT_LEN + len) {
+		rr->dropped++;
+		spin_unlock_irqrestore(&rr->lock, f);
+		return;
+	}
+
+	put_unaligned_le32(ktime_us_delta(now, rr->last), ent);
+	ent[4] = addr;
+	ent[5] = len;
+	rr->last = now;
+	for (i = 0; i < SX1278_RR_ENT_LEN; i++)
+		rr->ring[rr->head++ % SX1278_RR_RING_SIZE] = ent[i];
+	for (i = 0; i < len; i++)
+		rr->ring[rr->head++ % SX1278_RR_RING_SIZE] = data[i];
+	spin_unlock_irqrestore(&rr->lock, f);
+
+	wake_up_interruptible(&rr->wq);
+}
+
+/**
+ * sx1278_rr_replaying - Check the transactions are served by the replay
+ * @rr:		the record and replay state
+ *
+ * Return:	true / false for replaying / going to the chip
+ */
+static inline bool
+sx1278_rr_replaying(struct sx1278_rr *rr)
+{
+	return READ_ONCE(rr->replaying);
+}
+
+/**
+ * sx1278_rr_replay - Serve a SPI transaction with the recorded one
+ * @rr:		the record and replay state
+ * @addr:	the register address, with SX127X_SPI_WRITE for writes
+ * @rx:		the buffer for the read bytes, NULL for writes
+ * @len:	the length of the transaction in bytes
+ *
+ * The transaction waits for its recorded time.  A read without the matched
+ * recorded transaction reads zeros.
+ */
+static void
+sx1278_rr_replay(struct sx1278_rr *rr, u8 addr, u8 *rx, size_t len)
+{
+	const u8 *p;
+	size_t pos;
+	u64 ts;
+	s64 d;
+	int i;
+
+	if (rx)
+		memset(rx, 0, len);
+
+	mutex_lock(&rr->replay_lock);
+	if (!rr->replaying) {
+		mutex_unlock(&rr->replay_lock);
+		return;
+	}
+
+	pos = rr->pos;
+	ts = rr->ts;
+	for (i = 0; i <= SX1278_RR_LOOKAHEAD; i++) {
+		p = rr->log + pos;
+		if (pos + SX1278_RR_ENT_LEN > rr->log_len ||
+		    pos + SX1278_RR_ENT_LEN + p[5] > rr->log_len) {
+			i = SX1278_RR_LOOKAHEAD + 1;
+			break;
+		}
+		ts += get_unaligned_le32(p);
+		pos += SX1278_RR_ENT_LEN + p[5];
+		if (p[4] == addr)
+			break;
+	}
+
+	if (i > SX1278_RR_LOOKAHEAD) {
+		rr->mismatched++;
+	} else {
+		rr->mismatched += i;
+		if (!rr->served)
+			rr->start = ktime_sub_us(ktime_get(), ts);
+		d = ts - ktime_us_delta(ktime_get(), rr->start);
+		if (d > 0)
+			usleep_range(min_t(s64, d, USEC_PER_SEC),
+				     min_t(s64, d, USEC_PER_SEC) + 50);
+		else
+			rr->max_late = max_t(u32, rr->max_late,
+					     min_t(s64, -d, U32_MAX));
+		if (rx)
+			memcpy(rx, p + SX1278_RR_ENT_LEN,
+			       min_t(size_t, len, p[5]));
+		rr->pos = pos;
+		rr->ts = ts;
+		rr->served++;
+	}
+
+	/* Back to the chip after the whole record. */
+	if (rr->pos + SX1278_RR_ENT_LEN > rr->log_len) {
+		rr->replaying = false;
+		vfree(rr->log);
+		rr->log = NULL;
+	}
+	mutex_unlock(&rr->replay_lock);
+}
+
+/**
+ * sx1278_rr_free - Free the record and replay buffers
+ * @rr:		the record and replay state
+ */
+static void
+sx1278_rr_free(struct sx1278_rr *rr)
+{
+	rr->replaying = false;
+	vfree(rr->log);
+	rr->log = NULL;
+	vfree(rr->pending);
+	rr->pending = NULL;
+}
+
+static int
+sx1278_rr_record_open(struct inode *inode, struct file *file)
+{
+	struct sx1278_rr *rr = inode->i_private;
+	unsigned long f;
+	u8 *ring;
+	int ret = 0;
+
+	ring = vmalloc(SX1278_RR_RING_SIZE);
+	if (!ring)
+		return -ENOMEM;
+
+	/* Only one record reader at a time, the header goes first. */
+	spin_lock_irqsave(&rr->lock, f);
+	if (rr->ring) {
+		ret = -EBUSY;
+	} else {
+		memcpy(ring, SX1278_RR_MAGIC, 4);
+		put_unaligned_le32(SX1278_RR_VERSION, ring + 4);
+		rr->head = SX1278_RR_HDR_LEN;
+		rr->tail = 0;
+		rr->dropped = 0;
+		rr->last = ktime_get();
+		rr->ring = ring;
+	}
+	spin_unlock_irqrestore(&rr->lock, f);
+
+	if (ret) {
+		vfree(ring);
+		return ret;
+	}
+
+	file->private_data = rr;
+
+	return nonseekable_open(inode, file);
+}
+
+static int
+sx1278_rr_record_release(struct inode *inode, struct file *file)
+{
+	struct sx1278_rr *rr = file->private_data;
+	unsigned long f;
+	u8 *ring;
+
+	spin_lock_irqsave(&rr->lock, f);
+	ring = rr->ring;
+	rr->ring = NULL;
+	spin_unlock_irqrestore(&rr->lock, f);
+
+	vfree(ring);
+
+	return 0;
+}
+
+static ssize_t
+sx1278_rr_record_read(struct file *file, char __user *ubuf, size_t count,
+		      loff_t *ppos)
+{
+	struct sx1278_rr *rr = file->private_data;
+	unsigned int tail;
+	size_t len;
+	size_t done = 0;
+	unsigned long f;
+	int ret;
+
+	while (READ_ONCE(rr->head) == rr->tail) {
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		ret = wait_event_interruptible(rr->wq,
+					       READ_ONCE(rr->head) != rr->tail);
+		if (ret)
+			return ret;
+	}
+
+	/* The reader is the only consumer of the ring. */
+	spin_lock_irqsave(&rr->lock, f);
+	len = min_t(size_t, count, rr->head - rr->tail);
+	spin_unlock_irqrestore(&rr->lock, f);
+
+	while (done < len) {
+		tail = (rr->tail + done) % SX1278_RR_RING_SIZE;
+		count = min_t(size_t, len - done, SX1278_RR_RING_SIZE - tail);
+		if (copy_to_user(ubuf + done, rr->ring + tail, count))
+			break;
+		done += count;
+	}
+
+	spin_lock_irqsave(&rr->lock, f);
+	rr->tail += done;
+	spin_unlock_irqrestore(&rr->lock, f);
+
+	return done ? done : -EFAULT;
+}
+
+static const struct file_operations sx1278_rr_record_fops = {
+	.owner = THIS_MODULE,
+	.open = sx1278_rr_record_open,
+	.release = sx1278_rr_record_release,
+	.read = sx1278_rr_record_read,
+};
+
+static int
+sx1278_rr_replay_show(struct seq_file *s, void *data)
+{
+	struct sx1278_rr *rr = s->private;
+
+	mutex_lock(&rr->replay_lock);
+	seq_printf(s, "replaying: %d\n", rr->replaying);
+	seq_printf(s, "position: %zu/%zu\n", rr->pos, rr->log_len);
+	seq_printf(s, "served: %u\n", rr->served);
+	seq_printf(s, "mismatched: %u\n", rr->mismatched);
+	seq_printf(s, "recorded_us: %llu\n", rr->ts);
+	seq_printf(s, "max_late_us: %u\n", rr->max_late);
+	mutex_unlock(&rr->replay_lock);
+
+	return 0;
+}
+
+static int
+sx1278_rr_replay_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, sx1278_rr_replay_show, inode->i_private);
+}
+
+static ssize_t
+sx1278_rr_replay_write(struct file *file, const char __user *ubuf,
+		       size_t count, loff_t *ppos)
+{
+	struct sx1278_rr *rr = ((struct seq_file *)file->private_data)->private;
+	size_t max = (size_t)spi_replay_kb * 1024;
+	ssize_t ret = count;
+
+	mutex_lock(&rr->replay_lock);
+	if (rr->replaying) {
+		ret = -EBUSY;
+		goto sx1278_rr_replay_write_end;
+	}
+
+	if (!rr->pending) {
+		rr->pending = vmalloc(max);
+		if (!rr->pending) {
+			ret = -ENOMEM;
+			goto sx1278_rr_replay_write_end;
+		}
+		rr->pending_len = 0;
+	}
+
+	if (count > max - rr->pending_len) {
+		ret = -ENOSPC;
+	} else if (copy_from_user(rr->pending + rr->pending_len, ubuf,
+				  count)) {
+		ret = -EFAULT;
+	} else {
+		rr->pending_len += count;
+		*ppos += count;
+	}
+
+sx1278_rr_replay_write_end:
+	mutex_unlock(&rr->replay_lock);
+	return ret;
+}
+
+static int
+sx1278_rr_replay_release(struct inode *inode, struct file *file)
+{
+	struct sx1278_rr *rr = inode->i_private;
+
+	/* The written record takes over the transactions. */
+	mutex_lock(&rr->replay_lock);
+	if (rr->pending && rr->pending_len >= SX1278_RR_HDR_LEN &&
+	    !memcmp(rr->pending, SX1278_RR_MAGIC, 4) &&
+	    get_unaligned_le32(rr->pending + 4) == SX1278_RR_VERSION) {
+		vfree(rr->log);
+		rr->log = rr->pending;
+		rr->log_len = rr->pending_len;
+		rr->pos = SX1278_RR_HDR_LEN;
+		rr->ts = 0;
+		rr->served = 0;
+		rr->mismatched = 0;
+		rr->max_late = 0;
+		rr->replaying = true;
+	} else {
+		vfree(rr->pending);
+	}
+	rr->pending = NULL;
+	mutex_unlock(&rr->replay_lock);
+
+	return single_release(inode, file);
+}
+
+static const struct file_operations sx1278_rr_replay_fops = {
+	.owner = THIS_MODULE,
+	.open = sx1278_rr_replay_open,
+	.read = seq_read,
+	.write = sx1278_rr_replay_write,
+	.llseek = seq_lseek,
+	.release = sx1278_rr_replay_release,
+};
+
+/*--------------------------- SX1278 SPI Transport ---------------------------*/
+
+/*
+ * The hot paths of the state machine, polling the IRQ flags, switching the
+ * operating mode and the FIFO bursts, go straight to spi_sync with prebuilt
+ * messages and DMA-safe buffers.  They skip the regmap lock and formatting
+ * and the bounce buffers for the stack variables.  Only the state machine's
+ * work uses the transport, so it needs no lock.  All the registers are
+ * volatile in regmap, so there is no cache to be bypassed.  The configuration
+ * stays on regmap, which goes through the transport's regmap bus for the
+ * record and replay.
+ */
+
+#define SX127X_SPI_WRITE	0x80
+
+struct sx1278_xfer {
+	struct spi_device *spi;
+	struct sx1278_rr *rr;
+	/* A register read or write */
+	struct spi_transfer reg_t;
+	struct spi_message reg_msg;
+	/* Set FIFO pointer, FIFO address and read burst */
+	struct spi_transfer rx_t[3];
+	struct spi_message rx_msg;
+	/* Set FIFO pointer, FIFO address, write burst and set payload length */
+	struct spi_transfer tx_t[4];
+	struct spi_message tx_msg;
+
+	/* Read by DMA: the commands and TX data */
+	u8 reg_out[2] ____cacheline_aligned;
+	u8 ptr_out[2];
+	u8 len_out[2];
+	u8 rd_adr;
+	u8 wr_adr;
+	u8 fifo_out[SX127X_MAX_PAYLOAD_LEN];
+	/* Written by DMA, in their own cache lines */
+	u8 reg_in[2] ____cacheline_aligned;
+	u8 fifo_in[SX127X_MAX_PAYLOAD_LEN] ____cacheline_aligned;
+};
+
+/**
+ * sx1278_xfer_init - Build the SPI messages of the transport
+ * @x:		the transport allocated from DMA-safe memory
+ * @spi:	the SPI device of the LoRa chip
+ */
+static void
+sx1278_xfer_init(struct sx1278_xfer *x, struct spi_device *spi)
+{
+	x->spi = spi;
+	x->ptr_out[0] = SX127X_REG_FIFO_ADDR_PTR | SX127X_SPI_WRITE;
+	x->len_out[0] = SX127X_REG_PAYLOAD_LENGTH | SX127X_SPI_WRITE;
+	x->rd_adr = SX127X_REG_FIFO;
+	x->wr_adr = SX127X_REG_FIFO | SX127X_SPI_WRITE;
+
+	x->reg_t.tx_buf = x->reg_out;
+	x->reg_t.rx_buf = x->reg_in;
+	x->reg_t.len = 2;
+	spi_message_init_with_transfers(&x->reg_msg, &x->reg_t, 1);
+
+	x->rx_t[0].tx_buf = x->ptr_out;
+	x->rx_t[0].len = 2;
+	x->rx_t[0].cs_change = 1;
+	x->rx_t[1].tx_buf = &x->rd_adr;
+	x->rx_t[1].len = 1;
+	x->rx_t[2].rx_buf = x->fifo_in;
+	spi_message_init_with_transfers(&x->rx_msg, x->rx_t, 3);
+
+	x->tx_t[0].tx_buf = x->ptr_out;
+	x->tx_t[0].len = 2;
+	x->tx_t[0].cs_change = 1;
+	x->tx_t[1].tx_buf = &x->wr_adr;
+	x->tx_t[1].len = 1;
+	x->tx_t[2].tx_buf = x->fifo_out;
+	x->tx_t[2].cs_change = 1;
+	x->tx_t[3].tx_buf = x->len_out;
+	x->tx_t[3].len = 2;
+	spi_message_init_with_transfers(&x->tx_msg, x->tx_t, 4);
+}
+
+/**
+ * sx1278_xfer_read_reg - Read a register of the LoRa device
+ * @x:		the transport
+ * @reg:	the register address
+ *
+ * Return:	the register value / negative for failed
+ */
+static int
+sx1278_xfer_read_reg(struct sx1278_xfer *x, u8 reg)
+{
+	int err;
+
+	x->reg_out[0] = reg;
+	x->reg_out[1] = 0;
+	if (sx1278_rr_replaying(x->rr)) {
+		sx1278_rr_replay(x->rr, reg, &x->reg_in[1], 1);
+		return x->reg_in[1];
+	}
+
+	err = spi_sync(x->spi, &x->reg_msg);
+	if (err)
+		return err;
+	sx1278_rr_record(x->rr, reg, &x->reg_in[1], 1);
+
+	return x->reg_in[1];
+}
+
+/**
+ * sx1278_xfer_write_reg - Write a register of the LoRa device
+ * @x:		the transport
+ * @reg:	the register address
+ * @val:	the value going to be written
+ *
+ * Return:	0 / negative for success / failed
+ */
+static int
+sx1278_xfer_write_reg(struct sx1278_xfer *x, u8 reg, u8 val)
+{
+	int err;
+
+	x->reg_out[0] = reg | SX127X_SPI_WRITE;
+	x->reg_out[1] = val;
+	if (sx1278_rr_replaying(x->rr)) {
+		sx1278_rr_replay(x->rr, x->reg_out[0], NULL, 1);
+		return 0;
+	}
+
+	err = spi_sync(x->spi, &x->reg_msg);
+	if (!err)
+		sx1278_rr_record(x->rr, x->reg_out[0], &x->reg_out[1], 1);
+
+	return err;
+}
+
+/**
+ * sx1278_xfer_read_fifo - Read the received packet from RX FIFO
+ * @x:		the transport
+ * @ofs:	the offset in the packet to read from
+ * @len:	the length of the packet in bytes
+ *
+ * The packet from @ofs to @len is left at the same offset in x->fifo_in, so it
+ * can be read in parts.
+ *
+ * Return:	the length read up to / negative for failed
+ */
+static ssize_t
+sx1278_xfer_read_fifo(struct sx1278_xfer *x, size_t ofs, size_t len)
+{
+	int err;
+
+	len = min_t(size_t, len, SX127X_MAX_PAYLOAD_LEN);
+	if (ofs >= len)
+		return len;
+	x->ptr_out[1] = SX127X_FIFO_RX_BASE_ADDRESS + ofs;
+	x->rx_t[2].rx_buf = x->fifo_in + ofs;
+	x->rx_t[2].len = len - ofs;
+	if (sx1278_rr_replaying(x->rr)) {
+		sx1278_rr_replay(x->rr, x->ptr_out[0], NULL, 1);
+		sx1278_rr_replay(x->rr, x->rd_adr, x->fifo_in + ofs, len - ofs);
+		return len;
+	}
+
+	err = spi_sync(x->spi, &x->rx_msg);
+	if (err)
+		return err;
+	sx1278_rr_record(x->rr, x->ptr_out[0], &x->ptr_out[1], 1);
+	sx1278_rr_record(x->rr, x->rd_adr, x->fifo_in + ofs, len - ofs);
+
+	return len;
+}
+
+/**
+ * sx1278_xfer_write_fifo - Write the packet into TX FIFO
+ * @x:		the transport
+ * @len:	the length of the packet in x->fifo_out in bytes
+ *
+ * Return:	0 / negative for success / failed
+ */
+static int
+sx1278_xfer_write_fifo(struct sx1278_xfer *x, size_t len)
+{
+	int err;
+
+	len = min_t(size_t, len, SX127X_MAX_PAYLOAD_LEN);
+	x->ptr_out[1] = SX127X_FIFO_TX_BASE_ADDRESS;
+	x->tx_t[2].len = len;
+	x->len_out[1] = len;
+	if (sx1278_rr_replaying(x->rr)) {
+		sx1278_rr_replay(x->rr, x->ptr_out[0], NULL, 1);
+		sx1278_rr_replay(x->rr, x->wr_adr, NULL, len);
+		sx1278_rr_replay(x->rr, x->len_out[0], NULL, 1);
+		return 0;
+	}
+
+	err = spi_sync(x->spi, &x->tx_msg);
+	if (err)
+		return err;
+	sx1278_rr_record(x->rr, x->ptr_out[0], &x->ptr_out[1], 1);
+	sx1278_rr_record(x->rr, x->wr_adr, x->fifo_out, len);
+	sx1278_rr_record(x->rr, x->len_out[0], &x->len_out[1], 1);
+
+	return 0;
+}
+
+/**
+ * sx1278_xfer_regmap_write - Write registers for regmap
+ * @context:	the transport
+ * @data:	the register address with SX127X_SPI_WRITE and the values
+ * @count:	the length of the data in bytes
+ *
+ * Return:	0 / negative for success / failed
+ */
+static int
+sx1278_xfer_regmap_write(void *context, const void *data, size_t count)
+{
+	struct sx1278_xfer *x = context;
+	const u8 *buf = data;
+	int err;
+
+	if (sx1278_rr_replaying(x->rr)) {
+		sx1278_rr_replay(x->rr, buf[0], NULL, count - 1);
+		return 0;
+	}
+
+	err = spi_write(x->spi, data, count);
+	if (!err)
+		sx1278_rr_record(x->rr, buf[0], buf + 1, count - 1);
+
+	return err;
+}
+
+/**
+ * sx1278_xfer_regmap_read - Read registers for regmap
+ * @context:	the transport
+ * @reg:	the register address
+ * @reg_size:	the length of the register address in bytes
+ * @val:	the buffer for the read values
+ * @val_size:	the length of the values in bytes
+ *
+ * Return:	0 / negative for success / failed
+ */
+static int
+sx1278_xfer_regmap_read(void *context, const void *reg, size_t reg_size,
+			void *val, size_t val_size)
+{
+	struct sx1278_xfer *x = context;
+	int err;
+
+	if (sx1278_rr_replaying(x->rr)) {
+		sx1278_rr_replay(x->rr, *(const u8 *)reg, val, val_size);
+		return 0;
+	}
+
+	err = spi_write_then_read(x->spi, reg, reg_size, val, val_size);
+	if (!err)
+		sx1278_rr_record(x->rr, *(const u8 *)reg, val, val_size);
+
+	return err;
+}
+
+static const struct regmap_bus sx1278_xfer_regmap_bus = {
+	.write = sx1278_xfer_regmap_write,
+	.read = sx1278_xfer_regmap_read,
+};
+
+/*------------------------ SX1278 Monitor Mode Capture -----------------------*/
+
+/*
+ * The received frames, including the ones with payload CRC errors, can be
+ * captured through the debugfs "capture" file as a pcap stream.  Each frame is
+ * prefixed with an IEEE 802.15.4 TAP header (LINKTYPE_IEEE802_15_4_TAP) which
+ * carries the radio metadata of the frame.  For example:
+ *
+ *   cat /sys/kernel/debug/sx1278/spi0.0/capture | wireshark -k -i -
+ *
+ * The RX path only copies the frame and the raw metadata into a ring.  The
+ * TAP header is built when the capture is read.
+ */
+
+#ifndef SX1278_CAP_RING_LEN
+#define SX1278_CAP_RING_LEN		32
+#endif
+
+#define SX1278_PCAP_MAGIC_NS		0xA1B23C4D
+#define SX1278_PCAP_LINKTYPE_TAP	283
+
+/* IEEE 802.15.4 TAP TLV types */
+#define SX1278_TAP_FCS_TYPE		0
+#define SX1278_TAP_RSS			1
+#define SX1278_TAP_BIT_RATE		2
+#define SX1278_TAP_CHANNEL_ASSIGNMENT	3
+#define SX1278_TAP_SOF_TS		5
+#define SX1278_TAP_EOF_TS		6
+#define SX1278_TAP_LQI			10
+#define SX1278_TAP_CHANNEL_FREQUENCY	11
+/* Driver specific TAP TLV types */
+#define SX1278_TAP_LORA_MODULATION	0x8000
+#define SX1278_TAP_LORA_SNR		0x8001
+#define SX1278_TAP_LORA_FEI		0x8002
+#define SX1278_TAP_LORA_CRC_ERROR	0x8003
+
+#define SX1278_TAP_MAX_LEN		128
+
+/* The captured frame with its radio metadata. */
+struct sx1278_cap_rec {
+	u64 tstamp;		/* Estimated end of the frame in ns */
+	u32 toa;		/* Time-on-air in us */
+	u32 frq;		/* RF frequency in Hz */
+	u32 bw;			/* RF bandwidth in Hz */
+	s32 fei;		/* Frequency error in Hz */
+	s16 rssi;		/* Packet RSSI in dbm */
+	s8 snr;			/* Packet SNR in 0.25 db */
+	u8 sf;
+	u8 cr;			/* ex: 0x45 represents cr=4/5 */
+	u8 channel;
+	u8 page;
+	u8 lqi;
+	bool crc_err;
+	u8 len;
+	u8 data[IEEE802154_MTU];
+};
+
+struct sx1278_cap {
+	unsigned int head;
+	unsigned int tail;
+	u32 dropped;
+	bool hdr_sent;
+	struct sx1278_cap_rec ring[SX1278_CAP_RING_LEN];
+};
+
+/**
+ * sx1278_cap_active - Check the device is in monitor mode capturing frames
+ * @phy:	the SX1278 PHY
+ *
+ * Return:	true / false for capturing / not capturing
+ */
+static inline bool
+sx1278_cap_active(struct sx1278_phy *phy)
+{
+	return READ_ONCE(phy->cap) != NULL;
+}
+
+/**
+ * sx1278_cap_record - Put a received frame with its metadata into the capture
+ * @phy:	the SX1278 PHY
+ * @data:	the received frame
+ * @len:	the length of the received frame in bytes
+ * @crc_err:	the received frame's payload CRC is failed or not
+ *
+ * The frame's metadata is taken from the PHY's last RX metadata.
+ */
+static void
+sx1278_cap_record(struct sx1278_phy *phy, const u8 *data, u8 len,
+		  bool crc_err)
+{
+	struct sx1278_rx_meta *meta = &phy->rx_meta;
+	struct sx1278_cap_rec *rec;
+	unsigned long f;
+
+	spin_lock_irqsave(&phy->cap_lock, f);
+	if (!phy->cap) {
+		spin_unlock_irqrestore(&phy->cap_lock, f);
+		return;
+	}
+
+	if (phy->cap->head - phy->cap->tail >= SX1278_CAP_RING_LEN) {
+		phy->cap->dropped++;
+		spin_unlock_irqrestore(&phy->cap_lock, f);
+		return;
+	}
+
+	rec = &phy->cap->ring[phy->cap->head % SX1278_CAP_RING_LEN];
+	rec->tstamp = ktime_to_ns(meta->tstamp);
+	rec->toa = meta->toa;
+	rec->frq = phy->frq + phy->afc_offset;
+	rec->bw = phy->mod.bw;
+	rec->fei = meta->fei;
+	rec->rssi = meta->rssi;
+	rec->snr = meta->snr;
+	rec->sf = phy->mod.sf;
+	rec->cr = phy->mod.cr;
+	rec->channel = phy->hw->phy->current_channel;
+	rec->page = phy->hw->phy->current_page;
+	rec->lqi = meta->lqi;
+	rec->crc_err = crc_err;
+	rec->len = min_t(u8, len, IEEE802154_MTU);
+	memcpy(rec->data, data, rec->len);
+	phy->cap->head++;
+	spin_unlock_irqrestore(&phy->cap_lock, f);
+
+	wake_up_interruptible(&phy->cap_wq);
+}
+
+/**
+ * sx1278_cap_float - Encode an integer as an IEEE 754 single precision float
+ * @v:		the integer going to be encoded
+ *
+ * Return:	the bits of the single precision float
+ */
+static u32
+sx1278_cap_float(s32 v)
+{
+	u32 sign = 0;
+	u32 mag;
+	int e;
+
+	if (v == 0)
+		return 0;
+
+	if (v < 0) {
+		sign = 0x80000000;
+		mag = -v;
+	} else {
+		mag = v;
+	}
+
+	e = fls(mag) - 1;
+	mag = (e <= 23) ? mag << (23 - e) : mag >> (e - 23);
+
+	return sign | ((e + 127) << 23) | (mag & 0x7FFFFF);
+}
+
+/**
+ * sx1278_cap_put_tlv - Append a TLV into the TAP header
+ * @p:		the position going to append the TLV
+ * @type:	the TLV's type
+ * @val:	the TLV's value
+ * @len:	the length of the TLV's value in bytes
+ *
+ * Return:	the position next to the appended TLV with 4 bytes alignment
+ */
+static u8 *
+sx1278_cap_put_tlv(u8 *p, u16 type, const void *val, u16 len)
+{
+	put_unaligned_le16(type, p);
+	put_unaligned_le16(len, p + 2);
+	memcpy(p + 4, val, len);
+	memset(p + 4 + len, 0, ALIGN(len, 4) - len);
+
+	return p + 4 + ALIGN(len, 4);
+}
+
+/**
+ * sx1278_cap_build_tap - Build the TAP header of a captured frame
+ * @rec:	the captured frame
+ * @buf:	the buffer going to hold the TAP header
+ *
+ * Return:	the length of the TAP header in bytes
+ */
+static size_t
+sx1278_cap_build_tap(struct sx1278_cap_rec *rec, u8 *buf)
+{
+	u8 *p = buf + 4;
+	u8 v[8];
+	u32 rate;
+
+	/* The FCS is omitted by the driver. */
+	v[0] = 0;
+	p = sx1278_cap_put_tlv(p, SX1278_TAP_FCS_TYPE, v, 1);
+
+	put_unaligned_le32(sx1278_cap_float(rec->rssi), v);
+	p = sx1278_cap_put_tlv(p, SX1278_TAP_RSS, v, 4);
+
+	/* Rb = SF * BW / 2^SF * 4 / CR */
+	rate = (u32)div_u64((u64)rec->sf * rec->bw * 4,
+			    (1 << rec->sf) * (rec->cr & 0x0F));
+	put_unaligned_le32(rate, v);
+	p = sx1278_cap_put_tlv(p, SX1278_TAP_BIT_RATE, v, 4);
+
+	put_unaligned_le16(rec->channel, v);
+	v[2] = rec->page;
+	p = sx1278_cap_put_tlv(p, SX1278_TAP_CHANNEL_ASSIGNMENT, v, 3);
+
+	put_unaligned_le64(rec->tstamp - (u64)rec->toa * NSEC_PER_USEC, v);
+	p = sx1278_cap_put_tlv(p, SX1278_TAP_SOF_TS, v, 8);
+
+	put_unaligned_le64(rec->tstamp, v);
+	p = sx1278_cap_put_tlv(p, SX1278_TAP_EOF_TS, v, 8);
+
+	v[0] = rec->lqi;
+	p = sx1278_cap_put_tlv(p, SX1278_TAP_LQI, v, 1);
+
+	/* The channel frequency is in kHz. */
+	put_unaligned_le32(sx1278_cap_float(rec->frq / 1000), v);
+	p = sx1278_cap_put_tlv(p, SX1278_TAP_CHANNEL_FREQUENCY, v, 4);
+
+	v[0] = rec->sf;
+	v[1] = rec->cr;
+	put_unaligned_le32(rec->bw, v + 2);
+	p = sx1278_cap_put_tlv(p, SX1278_TAP_LORA_MODULATION, v, 6);
+
+	v[0] = rec->snr;
+	p = sx1278_cap_put_tlv(p, SX1278_TAP_LORA_SNR, v, 1);
+
+	put_unaligned_le32(rec->fei, v);
+	p = sx1278_cap_put_tlv(p, SX1278_TAP_LORA_FEI, v, 4);
+
+	v[0] = rec->crc_err;
+	p = sx1278_cap_put_tlv(p, SX1278_TAP_LORA_CRC_ERROR, v, 1);
+
+	/* TAP header: version, reserved and the total header length. */
+	buf[0] = 0;
+	buf[1] = 0;
+	put_unaligned_le16(p - buf, buf + 2);
+
+	return p - buf;
+}
+
+static int
+sx1278_cap_open(struct inode *inode, struct file *file)
+{
+	struct sx1278_phy *phy = inode->i_private;
+	struct sx1278_cap *cap;
+	unsigned long f;
+	int ret = 0;
+
+	cap = kzalloc(sizeof(*cap), GFP_KERNEL);
+	if (!cap)
+		return -ENOMEM;
+
+	/* Only one capture reader at a time. */
+	spin_lock_irqsave(&phy->cap_lock, f);
+	if (phy->cap)
+		ret = -EBUSY;
+	else
+		phy->cap = cap;
+	spin_unlock_irqrestore(&phy->cap_lock, f);
+
+	if (ret) {
+		kfree(cap);
+		return ret;
+	}
+
+	file->private_data = phy;
+
+	return nonseekable_open(inode, file);
+}
+
+static int
+sx1278_cap_release(struct inode *inode, struct file *file)
+{
+	struct sx1278_phy *phy = file->private_data;
+	struct sx1278_cap *cap;
+	unsigned long f;
+
+	spin_lock_irqsave(&phy->cap_lock, f);
+	cap = phy->cap;
+	phy->cap = NULL;
+	spin_unlock_irqrestore(&phy->cap_lock, f);
+
+	if (cap && cap->dropped)
+		dev_dbg(regmap_get_device(phy->map),
+			"%s: %u frames dropped\n", __func__, cap->dropped);
+	kfree(cap);
+
+	return 0;
+}
+
+static ssize_t
+sx1278_cap_read(struct file *file, char __user *ubuf, size_t count,
+		loff_t *ppos)
+{
+	struct sx1278_phy *phy = file->private_data;
+	struct sx1278_cap *cap = phy->cap;
+	struct sx1278_cap_rec *rec;
+	u8 buf[16 + SX1278_TAP_MAX_LEN + IEEE802154_MTU];
+	size_t tap_len;
+	size_t len;
+	size_t done = 0;
+	u64 ts;
+	u32 ns;
+	unsigned long f;
+	int ret;
+
+	/* The pcap global header goes first. */
+	if (!cap->hdr_sent) {
+		if (count < 24)
+			return -EINVAL;
+		put_unaligned(SX1278_PCAP_MAGIC_NS, (u32 *)buf);
+		put_unaligned((u16)2, (u16 *)(buf + 4));
+		put_unaligned((u16)4, (u16 *)(buf + 6));
+		put_unaligned((u32)0, (u32 *)(buf + 8));
+		put_unaligned((u32)0, (u32 *)(buf + 12));
+		put_unaligned((u32)(16 + SX1278_TAP_MAX_LEN + IEEE802154_MTU),
+			      (u32 *)(buf + 16));
+		put_unaligned((u32)SX1278_PCAP_LINKTYPE_TAP, (u32 *)(buf + 20));
+		if (copy_to_user(ubuf, buf, 24))
+			return -EFAULT;
+		cap->hdr_sent = true;
+		done = 24;
+	}
+
+	while (done == 0 && READ_ONCE(cap->head) == cap->tail) {
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		ret = wait_event_interruptible(phy->cap_wq,
+					       READ_ONCE(cap->head) != cap->tail);
+		if (ret)
+			return ret;
+	}
+
+	for (;;) {
+		/* The reader is the only consumer of the ring. */
+		spin_lock_irqsave(&phy->cap_lock, f);
+		if (cap->head == cap->tail) {
+			spin_unlock_irqrestore(&phy->cap_lock, f);
+			break;
+		}
+		rec = &cap->ring[cap->tail % SX1278_CAP_RING_LEN];
+		spin_unlock_irqrestore(&phy->cap_lock, f);
+
+		tap_len = sx1278_cap_build_tap(rec, buf + 16);
+		len = 16 + tap_len + rec->len;
+		if (done + len > count)
+			break;
+
+		ts = rec->tstamp;
+		ns = do_div(ts, NSEC_PER_SEC);
+		put_unaligned((u32)ts, (u32 *)buf);
+		put_unaligned(ns, (u32 *)(buf + 4));
+		put_unaligned((u32)(tap_len + rec->len), (u32 *)(buf + 8));
+		put_unaligned((u32)(tap_len + rec->len), (u32 *)(buf + 12));
+		memcpy(buf + 16 + tap_len, rec->data, rec->len);
+
+		if (copy_to_user(ubuf + done, buf, len))
+			return done ? done : -EFAULT;
+		done += len;
+
+		spin_lock_irqsave(&phy->cap_lock, f);
+		cap->tail++;
+		spin_unlock_irqrestore(&phy->cap_lock, f);
+	}
+
+	return done ? done : -EINVAL;
+}
+
+static const struct file_operations sx1278_cap_fops = {
+	.owner = THIS_MODULE,
+	.open = sx1278_cap_open,
+	.release = sx1278_cap_release,
+	.read = sx1278_cap_read,
+};
+
+/*---------------------- SX1278 IEEE 802.15.4 Functions ----------------------*/
+
+/* LoRa device's sensitivity in dbm. */
+#ifndef SX1278_IEEE_SENSITIVITY
+#define SX1278_IEEE_SENSITIVITY	(-148)
+#endif
+static s32 sensitivity = SX1278_IEEE_SENSITIVITY;
+module_param(sensitivity, int, 0000);
+MODULE_PARM_DESC(sensitivity, "RF receiver's sensitivity");
+
+#define SX1278_IEEE_ENERGY_RANGE	(-sensitivity)
+
+/* Packet length in implicit header mode: frame length, frame and padding. */
+#define SX1278_IEEE_IMPLICIT_LEN	(IEEE802154_MTU + 1)
+
+/* The RSSI samples averaged for an energy detection. */
+#ifndef SX1278_IEEE_ED_SAMPLES
+#define SX1278_IEEE_ED_SAMPLES		8
+#endif
+
+/**
+ * sx1278_ieee_sample_rssi - Average the current RSSI samples
+ * @phy:	the SX1278 PHY
+ * @n:		the number of the samples
+ * @max:	the maximum of the samples in dbm, could be NULL
+ *
+ * The device must be receiving.  The RSSI offset follows the low / high
+ * frequency band of the cached OP mode, so each sample is a single byte read.
+ *
+ * Return:	the average RSSI in dbm
+ */
+static s32
+sx1278_ieee_sample_rssi(struct sx1278_phy *phy, u32 n, s32 *max)
+{
+	s32 ofs = (phy->opmode & 0x08) ? -164 : -157;
+	s32 sum = 0;
+	s32 peak = S32_MIN;
+	u8 rssi;
+	u32 i;
+
+	n = (n > 0) ? n : 1;
+	for (i = 0; i < n; i++) {
+		regmap_raw_read(phy->map, SX127X_REG_RSSI_VALUE, &rssi, 1);
+		sum += ofs + rssi;
+		peak = max_t(s32, peak, ofs + rssi);
+	}
+
+	if (max)
+		*max = peak;
+
+	return sum / (s32)n;
+}
+
+/**
+ * sx1278_ieee_settle_us - Get the settling time of the RSSI after entering RX
+ * @phy:	the SX1278 PHY
+ *
+ * Return:	PLL lock and the RSSI of a couple of symbols in us
+ */
+static u32
+sx1278_ieee_settle_us(struct sx1278_phy *phy)
+{
+	u32 settle;
+
+	settle = (((u32)1 << phy->mod.sf) * 2000) / (phy->mod.bw / 1000);
+
+	return clamp_t(u32, settle, 250, 10000);
+}
+
+/* The longest wait for the state machine to serve a request in ms. */
+#ifndef SX1278_REQ_TIMEOUT
+#define SX1278_REQ_TIMEOUT	5000
+#endif
+
+/**
+ * sx1278_ieee_request - Request a measurement from the state machine
+ * @phy:	the SX1278 PHY
+ * @req:	SX1278_REQ_ED or SX1278_REQ_SCAN
+ *
+ * The measurement is made at the next idle point, so it never aborts a frame
+ * in flight.
+ *
+ * Return:	0 / negative values for done / failed
+ */
+static int
+sx1278_ieee_request(struct sx1278_phy *phy, u8 req)
+{
+	long ret;
+
+	spin_lock(&phy->req_lock);
+	phy->req_pending |= req;
+	spin_unlock(&phy->req_lock);
+
+	ret = wait_event_interruptible_timeout(phy->req_wq,
+				!((READ_ONCE(phy->req_pending)
+				   | READ_ONCE(phy->req_busy)) & req),
+				msecs_to_jiffies(SX1278_REQ_TIMEOUT));
+	if (ret < 0)
+		return ret;
+
+	return (ret > 0) ? 0 : -ETIMEDOUT;
+}
+
+static int
+sx1278_ieee_ed(struct ieee802154_hw *hw, u8 *level)
+{
+	struct sx1278_phy *phy = hw->priv;
+	s32 rssi;
+	s32 range = SX1278_IEEE_ENERGY_RANGE - 10;
+	int ret;
+
+	dev_dbg(regmap_get_device(phy->map), "%s\n", __func__);
+
+	/* ED: IEEE  802.15.4-2011 8.2.5 Recevier ED. */
+	if (phy->running) {
+		ret = sx1278_ieee_request(phy, SX1278_REQ_ED);
+		if (ret)
+			return ret;
+		rssi = READ_ONCE(phy->req_rssi);
+	} else {
+		rssi = sx1278_ieee_sample_rssi(phy, SX1278_IEEE_ED_SAMPLES,
+					       NULL);
+	}
+	if (rssi < (sensitivity + 10))
+		*level = 0;
+	else if (rssi >= 0)
+		*level = 255;
+	else
+		*level = (s32)255 * (rssi + range) / range;
+
+	return 0;
+}
+
+#ifndef SX1278_IEEE_CHANNEL_MIN
+#define SX1278_IEEE_CHANNEL_MIN		11
+#endif
+static u8 channel_min = SX1278_IEEE_CHANNEL_MIN;
+module_param(channel_min, byte, 0000);
+MODULE_PARM_DESC(channel_min, "Minimal channel number");
+
+#ifndef SX1278_IEEE_CHANNEL_MAX
+#define SX1278_IEEE_CHANNEL_MAX		11
+#endif
+static u8 channel_max = SX1278_IEEE_CHANNEL_MAX;
+module_param(channel_max, byte, 0000);
+MODULE_PARM_DESC(channel_max, "Maximum channel number");
+
+#ifndef SX1278_IEEE_CENTER_CARRIER_FRQ
+#define SX1278_IEEE_CENTER_CARRIER_FRQ	434000000
+#endif
+static u32 carrier_frq = SX1278_IEEE_CENTER_CARRIER_FRQ;
+module_param(carrier_frq, uint, 0000);
+MODULE_PARM_DESC(carrier_frq, "Center carrier frequency in Hz");
+
+#ifndef SX1278_IEEE_BANDWIDTH
+#define SX1278_IEEE_BANDWIDTH		500000
+#endif
+static u32 bandwidth = SX1278_IEEE_BANDWIDTH;
+module_param(bandwidth, uint, 0000);
+MODULE_PARM_DESC(bandwidth, "Bandwidth in Hz");
+
+/*
+ * A channel plan maps the regional LoRa channels onto IEEE 802.15.4 channel
+ * pages.  Each page holds evenly spaced channels, whose RF bandwidth is
+ * applied together with the frequency.  Without a channel plan the channels
+ * spread around the center carrier frequency by the RF bandwidth.
+ */
+struct sx1278_chplan_page {
+	u8 page;
+	u8 count;		/* Number of channels from channel 0 */
+	u32 frq;		/* RF frequency of channel 0 in Hz */
+	u32 spacing;		/* Channel spacing in Hz */
+	u32 bw;			/* RF bandwidth in Hz */
+};
+
+struct sx1278_chplan {
+	const char *name;
+	const struct sx1278_chplan_page *pages;
+	u8 n_pages;
+};
+
+static const struct sx1278_chplan_page sx1278_eu433_pages[] = {
+	{ 0, 8, 433175000, 200000, 125000 },
+};
+
+static const struct sx1278_chplan_page sx1278_eu868_pages[] = {
+	{ 0, 8, 867100000, 200000, 125000 },
+};
+
+/* Page 0 to 7 are the 125kHz sub-bands 1 to 8, page 8 is the 500kHz band. */
+static const struct sx1278_chplan_page sx1278_us915_pages[] = {
+	{ 0, 8, 902300000, 200000, 125000 },
+	{ 1, 8, 903900000, 200000, 125000 },
+	{ 2, 8, 905500000, 200000, 125000 },
+	{ 3, 8, 907100000, 200000, 125000 },
+	{ 4, 8, 908700000, 200000, 125000 },
+	{ 5, 8, 910300000, 200000, 125000 },
+	{ 6, 8, 911900000, 200000, 125000 },
+	{ 7, 8, 913500000, 200000, 125000 },
+	{ 8, 8, 903000000, 1600000, 500000 },
+};
+
+static const struct sx1278_chplan sx1278_chplans[] = {
+	{ "eu433", sx1278_eu433_pages, ARRAY_SIZE(sx1278_eu433_pages) },
+	{ "eu868", sx1278_eu868_pages, ARRAY_SIZE(sx1278_eu868_pages) },
+	{ "us915", sx1278_us915_pages, ARRAY_SIZE(sx1278_us915_pages) },
+};
+
+static char *channel_plan;
+module_param(channel_plan, charp, 0000);
+MODULE_PARM_DESC(channel_plan, "Channel plan: eu433, eu868 or us915");
+
+/* The available channel numbers of a page in IEEE 802.15.4 */
+#define SX1278_IEEE_PAGE_CHANNELS	(IEEE802154_MAX_CHANNEL + 1)
+
+/**
+ * sx1278_ieee_add_chan - Add an available channel of the LoRa device
+ * @phy:	the SX1278 PHY
+ * @page:	the channel page
+ * @channel:	the channel number
+ * @fr:		the RF frequency in Hz
+ * @bw:		the RF bandwidth in Hz, 0 for keeping the current one
+ */
+static void
+sx1278_ieee_add_chan(struct sx1278_phy *phy, u8 page, u8 channel, u32 fr,
+		     u32 bw)
+{
+	struct sx1278_chan *chan;
+
+	if (page > IEEE802154_MAX_PAGE || channel > IEEE802154_MAX_CHANNEL)
+		return;
+
+	if (fr < phy->variant->frq_min || fr > phy->variant->frq_max) {
+		dev_warn(regmap_get_device(phy->map),
+			 "channel %u/%u: %u Hz is out of %s's range\n",
+			 page, channel, fr, phy->variant->name);
+		return;
+	}
+
+	chan = &phy->chans[phy->n_chans++];
+	chan->page = page;
+	chan->channel = channel;
+	chan->frq = fr;
+	chan->frf = sx127X_lorafrq2frf(fr, phy->cfg.xosc);
+	chan->bw = bw;
+	phy->hw->phy->supported.channels[page] |= BIT(channel);
+}
+
+/**
+ * sx1278_ieee_build_chans - Build the available channels of the LoRa device
+ * @phy:	the SX1278 PHY
+ *
+ * The channels come from the "channel-frequencies" table in DT, the named
+ * channel plan, or the center carrier frequency in order.  Their FRF values
+ * are calculated once here.
+ *
+ * Return:	0 / negative for success / failed
+ */
+static int
+sx1278_ieee_build_chans(struct sx1278_phy *phy)
+{
+	struct device *dev = regmap_get_device(phy->map);
+	const struct sx1278_chplan_page *pg;
+	const struct sx1278_chplan *plan = NULL;
+	const char *name = channel_plan;
+	struct sx1278_config *cfg = &phy->cfg;
+	u32 *frqs = NULL;
+	int n, i, j;
+
+	memset(phy->hw->phy->supported.channels, 0,
+	       sizeof(phy->hw->phy->supported.channels));
+
+	n = of_property_count_u32_elems(dev->of_node, "channel-frequencies");
+	if (n > 0) {
+		frqs = devm_kcalloc(dev, n, sizeof(*frqs), GFP_KERNEL);
+		if (!frqs)
+			return -ENOMEM;
+		of_property_read_u32_array(dev->of_node, "channel-frequencies",
+					   frqs, n);
+	} else {
+		of_property_read_string(dev->of_node, "channel-plan", &name);
+		for (i = 0; name && i < ARRAY_SIZE(sx1278_chplans); i++) {
+			if (!strcmp(name, sx1278_chplans[i].name))
+				plan = &sx1278_chplans[i];
+		}
+		if (name && !plan) {
+			dev_err(dev, "unknown channel plan %s\n", name);
+			return -EINVAL;
+		}
+
+		if (plan) {
+			for (n = 0, i = 0; i < plan->n_pages; i++)
+				n += plan->pages[i].count;
+		} else {
+			if (cfg->ch_min > cfg->ch_max ||
+			    cfg->ch_max > IEEE802154_MAX_CHANNEL)
+				return -EINVAL;
+			n = cfg->ch_max - cfg->ch_min + 1;
+		}
+	}
+
+	phy->chans = devm_kcalloc(dev, n, sizeof(*phy->chans), GFP_KERNEL);
+	if (!phy->chans)
+		return -ENOMEM;
+	phy->n_chans = 0;
+
+	if (frqs) {
+		/* Number the DT table over the pages in order. */
+		for (i = 0; i < n; i++)
+			sx1278_ieee_add_chan(phy, i / SX1278_IEEE_PAGE_CHANNELS,
+					     i % SX1278_IEEE_PAGE_CHANNELS,
+					     frqs[i], cfg->bw);
+		devm_kfree(dev, frqs);
+	} else if (plan) {
+		for (i = 0; i < plan->n_pages; i++) {
+			pg = &plan->pages[i];
+			for (j = 0; j < pg->count; j++)
+				sx1278_ieee_add_chan(phy, pg->page, j,
+						     pg->frq + j * pg->spacing,
+						     pg->bw);
+		}
+	} else {
+		/* Spread around the center carrier frequency. */
+		for (i = cfg->ch_min; i <= cfg->ch_max; i++)
+			sx1278_ieee_add_chan(phy, 0, i, cfg->carrier +
+					     (i - (cfg->ch_min + cfg->ch_max) / 2) *
+					     (s32)cfg->bw, 0);
+	}
+
+	if (!phy->n_chans) {
+		dev_err(dev, "no available channel\n");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/**
+ * sx1278_ieee_find_chan - Find an available channel of the LoRa device
+ * @phy:	the SX1278 PHY
+ * @page:	the channel page
+ * @channel:	the channel number
+ *
+ * Return:	the channel or NULL for not available
+ */
+static struct sx1278_chan *
+sx1278_ieee_find_chan(struct sx1278_phy *phy, u8 page, u8 channel)
+{
+	u16 i;
+
+	for (i = 0; i < phy->n_chans; i++) {
+		if (phy->chans[i].page == page &&
+		    phy->chans[i].channel == channel)
+			return &phy->chans[i];
+	}
+
+	return NULL;
+}
+
+/**
+ * sx1278_ieee_tune - Tune the LoRa device to a channel
+ * @phy:	the SX1278 PHY
+ * @chan:	the channel going to be tuned
+ *
+ * The frequency correction of the automatic frequency control is kept.
+ */
+static void
+sx1278_ieee_tune(struct sx1278_phy *phy, struct sx1278_chan *chan)
+{
+	if (chan->bw && chan->bw != phy->mod.bw) {
+		sx127X_set_lorabw(phy->map, chan->bw);
+		sx127X_get_loramod(phy->map, &phy->mod);
+	}
+
+	phy->chan = chan;
+	phy->frq = chan->frq;
+	sx127X_set_lorafrf(phy->map, chan->frf + phy->afc_frf, chan->frq);
+	phy->opmode = sx127X_get_mode(phy->map);
+}
+
+/**
+ * sx1278_ieee_resume_rx - Start polling and receiving after configuration
+ * @phy:	the SX1278 PHY
+ */
+static void
+sx1278_ieee_resume_rx(struct sx1278_phy *phy)
+{
+	phy->pm_asleep = false;
+	phy->opmode = sx127X_get_mode(phy->map);
+	/* Clear all of the IRQ flags and wait for receiving. */
+	sx127X_clear_loraallflag(phy->map);
+	sx127X_set_state(phy->map, SX127X_RXSINGLE_MODE);
+	phy->last_poll = ktime_get();
+	phy->suspended = false;
+	mod_timer(&phy->bus->timer, jiffies + 1);
+}
+
+/**
+ * sx1278_ieee_rx_ct_reset - Drop the payload streamed by the cut-through RX
+ * @phy:	the SX1278 PHY
+ */
+static void
+sx1278_ieee_rx_ct_reset(struct sx1278_phy *phy)
+{
+	kfree_skb(phy->rx_ct.skb);
+	memset(&phy->rx_ct, 0, sizeof(phy->rx_ct));
+}
+
+/**
+ * sx1278_ieee_pause - Stop polling the LoRa device
+ * @phy:	the SX1278 PHY
+ *
+ * A frame in the middle of transmitting will be sent again after polling is
+ * resumed by sx1278_ieee_resume_rx.
+ */
+static void
+sx1278_ieee_pause(struct sx1278_phy *phy)
+{
+	phy->suspended = true;
+	/* Wait for the bus pass which may be polling the device. */
+	mutex_lock(&phy->bus->lock);
+	mutex_unlock(&phy->bus->lock);
+
+	/* Nothing owns the radio, and the queued frame will be reloaded. */
+	atomic_set(&phy->state, SX1278_ST_IDLE);
+	phy->tdma.beacon_tx = false;
+	/* The frame waiting for its ACK is sent again after resuming. */
+	phy->ack_wait = false;
+	phy->ack_tx = false;
+	sx1278_ieee_rx_ct_reset(phy);
+}
+
+static int
+sx1278_ieee_set_channel(struct ieee802154_hw *hw, u8 page, u8 channel)
+{
+	struct sx1278_phy *phy = hw->priv;
+	struct sx1278_chan *chan;
+
+	dev_dbg(regmap_get_device(phy->map),
+		"%s page: %u channel: %u\n", __func__, page, channel);
+
+	chan = sx1278_ieee_find_chan(phy, page, channel);
+	if (!chan)
+		return -EINVAL;
+
+	/* Retuning goes through sleep state, so wait for an idle point. */
+	if (phy->running) {
+		spin_lock(&phy->req_lock);
+		phy->req_chan = chan;
+		phy->req_pending |= SX1278_REQ_CHANNEL;
+		spin_unlock(&phy->req_lock);
+	} else {
+		sx1278_ieee_tune(phy, chan);
+	}
+
+	return 0;
+}
+
+/* Automatic frequency control to follow the crystal drift of the peers. */
+static bool afc;
+module_param(afc, bool, 0000);
+MODULE_PARM_DESC(afc, "Automatic frequency correction from the FEI registers");
+
+/* The smallest correction worth a FRF update in Hz. */
+#ifndef SX1278_IEEE_AFC_MIN_STEP
+#define SX1278_IEEE_AFC_MIN_STEP	200
+#endif
+
+/**
+ * sx1278_ieee_afc - Correct the RF frequency with the last frequency error
+ * @phy:	the SX1278 PHY
+ *
+ * The frequency error of each good packet is integrated with gain 1/4 into the
+ * correction.  The correction is limited within +/- 1/4 bandwidth which LoRa
+ * demodulator can still lock on.  Changing FRF goes through sleep state, which
+ * clears the FIFO and aborts an ACK on air, so the retune waits for an idle
+ * point.
+ */
+static void
+sx1278_ieee_afc(struct sx1278_phy *phy)
+{
+	s32 lim = phy->mod.bw / 4;
+	s32 ofs;
+
+	ofs = phy->afc_target + phy->rx_meta.fei / 4;
+	ofs = clamp_t(s32, ofs, -lim, lim);
+	phy->afc_target = ofs;
+
+	if (abs(ofs - phy->afc_offset) < SX1278_IEEE_AFC_MIN_STEP)
+		return;
+
+	dev_dbg(regmap_get_device(phy->map),
+		"%s: frequency offset %d -> %d Hz\n", __func__,
+		phy->afc_offset, ofs);
+
+	phy->afc_offset = ofs;
+	phy->afc_frf = div_s64((s64)ofs * __POW_2_19, phy->cfg.xosc);
+	spin_lock(&phy->req_lock);
+	phy->req_pending |= SX1278_REQ_AFC;
+	spin_unlock(&phy->req_lock);
+}
+
+static int
+sx1278_afc_show(struct seq_file *s, void *data)
+{
+	struct sx1278_phy *phy = s->private;
+
+	seq_printf(s, "enabled: %d\n", phy->cfg.afc);
+	seq_printf(s, "last_fei: %d Hz\n", phy->rx_meta.fei);
+	seq_printf(s, "offset: %d Hz\n", phy->afc_offset);
+	seq_printf(s, "frequency: %u Hz\n", phy->frq + phy->afc_offset);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(sx1278_afc);
+
+/* RF output powers in mbm through RFO pin */
+static const s32 sx1278_rfo_powers[] = {
+	-300, -200, -100, 0, 100, 200, 300, 400, 500, 600, 700, 800, 900, 1000,
+	1100, 1200, 1300, 1400, 1500};
+
+/* RF output powers in mbm through PA_BOOST pin */
+static const s32 sx1278_paboost_powers[] = {
+	200, 300, 400, 500, 600, 700, 800, 900, 1000, 1100, 1200, 1300, 1400,
+	1500, 1600, 1700, 2000};
+
+static const struct sx1278_variant sx1276_variant = {
+	.name = "sx1276",
+	.frq_min = 137000000,
+	.frq_max = 1020000000,
+	.sprf_max = 4096,
+};
+
+static const struct sx1278_variant sx1277_variant = {
+	.name = "sx1277",
+	.frq_min = 137000000,
+	.frq_max = 1020000000,
+	.sprf_max = 512,
+};
+
+static const struct sx1278_variant sx1278_variant = {
+	.name = "sx1278",
+	.frq_min = 137000000,
+	.frq_max = 525000000,
+	.sprf_max = 4096,
+};
+
+static const struct sx1278_variant sx1279_variant = {
+	.name = "sx1279",
+	.frq_min = 137000000,
+	.frq_max = 960000000,
+	.sprf_max = 4096,
+};
+
+static int
+sx1278_ieee_set_txpower(struct ieee802154_hw *hw, s32 mbm)
+{
+	struct sx1278_phy *phy = hw->priv;
+	s32 dbm = sx127X_mbm2dbm(mbm);
+
+	dev_dbg(regmap_get_device(phy->map),
+		"%s TX power: %d mbm\n", __func__, mbm);
+
+	if (phy->running) {
+		spin_lock(&phy->req_lock);
+		phy->req_dbm = dbm;
+		phy->req_pending |= SX1278_REQ_TXPOWER;
+		spin_unlock(&phy->req_lock);
+		return 0;
+	}
+
+	sx127X_set_lorapower(phy->map, dbm);
+	/* The saved radio state is out of date. */
+	if (phy->pm_asleep)
+		phy->pm_valid = false;
+
+	return 0;
+}
+
+/**
+ * sx1278_ieee_hand_over - Hand over the radio to another owner
+ * @phy:	the SX1278 PHY
+ * @from:	the expected current owner
+ * @to:		the new owner
+ *
+ * Return:	true / false for handed over / the radio is owned by others
+ */
+static bool
+sx1278_ieee_hand_over(struct sx1278_phy *phy, int from, int to)
+{
+	int old = atomic_read(&phy->state);
+
+	do {
+		if ((old & SX1278_ST_OWNER) != from)
+			return false;
+	} while (!atomic_try_cmpxchg(&phy->state, &old,
+				     (old & ~SX1278_ST_OWNER) | to));
+
+	return true;
+}
+
+int
+sx1278_ieee_rx(struct ieee802154_hw *hw)
+{
+	struct sx1278_phy *phy = hw->priv;
+
+	dev_dbg(regmap_get_device(phy->map), "%s\n", __func__);
+
+	if (sx1278_ieee_hand_over(phy, SX1278_ST_IDLE, SX1278_ST_RX_ARMED)) {
+		phy->opmode = (phy->opmode & 0xF8) | SX127X_RXSINGLE_MODE;
+		sx1278_xfer_write_reg(phy->xfer, SX127X_REG_OP_MODE,
+				      phy->opmode);
+		return 0;
+	} else {
+		dev_dbg(regmap_get_device(phy->map),
+			"%s: device is busy\n", __func__);
+		return -EBUSY;
+	}
+}
+
+/**
+ * sx1278_ieee_rx_meta - Collect the metadata of the received frame
+ * @phy:	the SX1278 PHY
+ * @len:	the length of the received frame in bytes
+ *
+ * The end of the frame is estimated as the middle of the polling interval in
+ * which RX done is detected.  The start of the frame is the end of the frame
+ * minus the time-on-air.
+ */
+static void
+sx1278_ieee_rx_meta(struct sx1278_phy *phy, u8 len)
+{
+	struct sx1278_rx_meta *meta = &phy->rx_meta;
+	s32 range = SX1278_IEEE_ENERGY_RANGE;
+	s32 rssi;
+
+	meta->len = len;
+	meta->tstamp = ktime_mono_to_real(phy->rx_done);
+	meta->toa = sx127X_lora_toa(&phy->mod, len);
+
+	rssi = sx127X_get_loralastpktrssi(phy->map);
+	meta->rssi = rssi;
+	regmap_raw_read(phy->map, SX127X_REG_PKT_SNR_VALUE, &meta->snr, 1);
+	meta->fei = sx127X_get_lorafei(phy->map, phy->cfg.xosc, phy->mod.bw);
+
+	/* LQI: IEEE  802.15.4-2011 8.2.6 Link quality indicator. */
+	rssi = clamp_t(s32, rssi, -range, 0);
+	meta->lqi = (s32)255 * (rssi + range) / range;
+}
+
+/**
+ * sx1278_ieee_implicit_frame - Get the frame out of an implicit header packet
+ * @buf:	the received packet
+ * @len:	the length of the received packet in bytes
+ *
+ * The packet in implicit header mode has fixed length.  So, the first byte of
+ * the packet is the actual frame's length followed by the frame and padding.
+ *
+ * Return:	Positive / negtive values for the frame's length / invalid packet
+ */
+static int
+sx1278_ieee_implicit_frame(const u8 *buf, size_t len)
+{
+	if (len < 1 || buf[0] > IEEE802154_MTU || buf[0] > len - 1)
+		return -EINVAL;
+
+	return buf[0];
+}
+
+/**
+ * sx1278_ieee_send - Write the frame into the TX FIFO of the LoRa device
+ * @phy:	the SX1278 PHY
+ * @data:	the frame going to be sent
+ * @len:	the length of the frame in bytes
+ */
+static void
+sx1278_ieee_send(struct sx1278_phy *phy, const u8 *data, size_t len)
+{
+	u8 *buf = phy->xfer->fifo_out;
+
+	if (!phy->implicit_len) {
+		len = min_t(size_t, len, SX127X_MAX_PAYLOAD_LEN);
+		memcpy(buf, data, len);
+		sx1278_xfer_write_fifo(phy->xfer, len);
+		return;
+	}
+
+	/* Frame length, frame and padding in the fixed length packet. */
+	memset(buf, 0, phy->implicit_len);
+	buf[0] = len;
+	memcpy(buf + 1, data, min_t(size_t, len, phy->implicit_len - 1));
+	sx1278_xfer_write_fifo(phy->xfer, phy->implicit_len);
+}
+
+/* MODEM_STAT bits of a reception in progress */
+#define SX127X_MODEM_STAT_DETECTED	0x01
+#define SX127X_MODEM_STAT_SYNCED	0x02
+#define SX127X_MODEM_STAT_HEADER	0x08
+
+/**
+ * sx1278_ieee_abort_rx - Stop the armed single reception
+ * @phy:	the SX1278 PHY
+ * @state:	the operating mode of the chip, updated to standby
+ *
+ * The RX flags raised in the meantime are cleared, so the aborted reception
+ * is not taken as a frame later.
+ *
+ * Return:	true / false for stopped / no reception armed
+ */
+static bool
+sx1278_ieee_abort_rx(struct sx1278_phy *phy, int *state)
+{
+	if (!sx1278_ieee_hand_over(phy, SX1278_ST_RX_ARMED, SX1278_ST_IDLE))
+		return false;
+
+	phy->opmode = (phy->opmode & 0xF8) | SX127X_STANDBY_MODE;
+	sx1278_xfer_write_reg(phy->xfer, SX127X_REG_OP_MODE, phy->opmode);
+	sx1278_xfer_write_reg(phy->xfer, SX127X_REG_IRQ_FLAGS,
+			      SX127X_FLAG_RXTIMEOUT
+			      | SX127X_FLAG_RXDONE
+			      | SX127X_FLAG_PAYLOADCRCERROR
+			      | SX127X_FLAG_VALIDHEADER);
+	sx1278_ieee_rx_ct_reset(phy);
+	*state = SX127X_STANDBY_MODE;
+
+	return true;
+}
+
+/**
+ * sx1278_ieee_preempt_rx - Stop the idle reception for a queued TX
+ * @phy:	the SX1278 PHY
+ * @state:	the operating mode of the chip, updated to standby
+ *
+ * The TX does not wait for the single reception to time out, unless a
+ * preamble or a header is being received.
+ *
+ * Return:	true / false for stopped / keep receiving
+ */
+static bool
+sx1278_ieee_preempt_rx(struct sx1278_phy *phy, int *state)
+{
+	int stat;
+
+	if (*state != SX127X_RXSINGLE_MODE)
+		return false;
+
+	stat = sx1278_xfer_read_reg(phy->xfer, SX127X_REG_MODEM_STAT);
+	if (stat < 0 || stat & (SX127X_MODEM_STAT_DETECTED
+				| SX127X_MODEM_STAT_SYNCED
+				| SX127X_MODEM_STAT_HEADER))
+		return false;
+
+	return sx1278_ieee_abort_rx(phy, state);
+}
+
+/*
+ * The EU sub-bands limit the duty cycle of each transmitter.  Each sub-band has
+ * an airtime token bucket, which is refilled at the duty cycle ratio and holds
+ * the budget of the observation window at most.  Every TX is charged with its
+ * time-on-air, and a queued frame is deferred until its sub-band's budget
+ * covers the frame.  The remaining budgets are in debugfs "dutycycle".
+ */
+
+/* ETSI EN 300 220 observation period of one hour, 0 for no limit */
+#ifndef SX1278_DC_WINDOW
+#define SX1278_DC_WINDOW	3600
 #endif
-static u8 channel_min = SX1278_IEEE_CHANNEL_MIN;
-module_param(channel_min, byte, 0000);
-MODULE_PARM_DESC(channel_min, "Minimal channel number");
+static u32 duty_window = SX1278_DC_WINDOW;
+module_param(duty_window, uint, 0000);
+MODULE_PARM_DESC(duty_window, "Duty cycle observation window in s, 0 for none");
+
+struct sx1278_dc_band {
+	u32 frq_min;
+	u32 frq_max;
+	u32 permille;		/* Duty cycle limit in 0.1% */
+};
+
+/* ERC Recommendation 70-03 Annex 1 sub-bands */
+static const struct sx1278_dc_band sx1278_dc_bands[SX1278_DC_BANDS] = {
+	{ 433050000, 434790000, 100 },
+	{ 863000000, 865000000, 1 },
+	{ 865000000, 868000000, 10 },
+	{ 868000000, 868600000, 10 },
+	{ 868700000, 869200000, 1 },
+	{ 869400000, 869650000, 100 },
+	{ 869700000, 870000000, 10 },
+};
+
+/**
+ * sx1278_dc_bucket - Get the airtime bucket of the current channel
+ * @phy:	the SX1278 PHY
+ *
+ * Return:	the bucket / NULL for the channel without duty cycle limit
+ */
+static struct sx1278_dc *
+sx1278_dc_bucket(struct sx1278_phy *phy)
+{
+	u32 frq;
+	int i;
+
+	if (!phy->cfg.duty_window || !phy->chan)
+		return NULL;
+
+	frq = phy->chan->frq;
+	for (i = 0; i < SX1278_DC_BANDS; i++)
+		if (frq >= sx1278_dc_bands[i].frq_min &&
+		    frq < sx1278_dc_bands[i].frq_max)
+			return &phy->dc[i];
+
+	return NULL;
+}
+
+/**
+ * sx1278_dc_budget - Calculate the airtime budget of a bucket
+ * @phy:	the SX1278 PHY
+ * @dc:		the airtime bucket
+ * @now:	the time up to which the bucket is refilled
+ *
+ * Return:	the remaining airtime in us
+ */
+static s64
+sx1278_dc_budget(struct sx1278_phy *phy, const struct sx1278_dc *dc,
+		 ktime_t now)
+{
+	const struct sx1278_dc_band *band = &sx1278_dc_bands[dc - phy->dc];
+	s64 cap = (s64)band->permille * phy->cfg.duty_window * 1000;
+	s64 tokens;
+
+	tokens = READ_ONCE(dc->tokens)
+		 + div_s64(ktime_us_delta(now, READ_ONCE(dc->last))
+			   * band->permille, 1000);
+
+	return min(tokens, cap);
+}
+
+/**
+ * sx1278_dc_refill - Refill the airtime bucket up to now
+ * @phy:	the SX1278 PHY
+ * @dc:		the airtime bucket
+ */
+static void
+sx1278_dc_refill(struct sx1278_phy *phy, struct sx1278_dc *dc)
+{
+	ktime_t now = ktime_get();
+
+	WRITE_ONCE(dc->tokens, sx1278_dc_budget(phy, dc, now));
+	WRITE_ONCE(dc->last, now);
+}
+
+/**
+ * sx1278_dc_reset - Fill all the airtime buckets
+ * @phy:	the SX1278 PHY
+ */
+static void
+sx1278_dc_reset(struct sx1278_phy *phy)
+{
+	int i;
+
+	for (i = 0; i < SX1278_DC_BANDS; i++) {
+		phy->dc[i].tokens = (s64)sx1278_dc_bands[i].permille
+				    * phy->cfg.duty_window * 1000;
+		phy->dc[i].last = ktime_get();
+		phy->dc[i].deferred = 0;
+	}
+}
+
+/**
+ * sx1278_dc_admit - Check the budget for sending a frame on this channel
+ * @phy:	the SX1278 PHY
+ * @len:	the length of the frame in bytes
+ *
+ * Return:	true / false for the frame can be sent / deferred
+ */
+static bool
+sx1278_dc_admit(struct sx1278_phy *phy, size_t len)
+{
+	struct sx1278_dc *dc = sx1278_dc_bucket(phy);
+	u32 toa;
+
+	if (!dc)
+		return true;
+
+	sx1278_dc_refill(phy, dc);
+	toa = sx127X_lora_toa(&phy->mod, (phy->implicit_len) ?
+					 phy->implicit_len : len);
+	if (dc->tokens >= toa)
+		return true;
+
+	/* Count each deferred frame once, not each polling. */
+	if (!dc->deferring) {
+		dc->deferring = true;
+		dc->deferred++;
+	}
+
+	return false;
+}
+
+/**
+ * sx1278_dc_charge - Charge the airtime of a started TX
+ * @phy:	the SX1278 PHY
+ * @len:	the length of the frame in bytes
+ *
+ * ACKs and beacons are charged without being deferred, so the budget may go
+ * below zero.
+ */
+static void
+sx1278_dc_charge(struct sx1278_phy *phy, size_t len)
+{
+	struct sx1278_dc *dc = sx1278_dc_bucket(phy);
+
+	if (!dc)
+		return;
+
+	sx1278_dc_refill(phy, dc);
+	WRITE_ONCE(dc->tokens, dc->tokens
+		   - sx127X_lora_toa(&phy->mod, (phy->implicit_len) ?
+						phy->implicit_len : len));
+	dc->deferring = false;
+}
+
+static int
+sx1278_dc_show(struct seq_file *s, void *data)
+{
+	struct sx1278_phy *phy = s->private;
+	struct sx1278_dc *cur = sx1278_dc_bucket(phy);
+	struct sx1278_dc *dc;
+	ktime_t now = ktime_get();
+	int i;
+
+	seq_printf(s, "window: %u s\n", phy->cfg.duty_window);
+	seq_puts(s, "band                    limit  budget_us     deferred\n");
+	for (i = 0; i < SX1278_DC_BANDS; i++) {
+		dc = &phy->dc[i];
+		seq_printf(s, "%9u-%9u%c %3u.%u%% %12lld %8u\n",
+			   sx1278_dc_bands[i].frq_min,
+			   sx1278_dc_bands[i].frq_max, (dc == cur) ? '*' : ' ',
+			   sx1278_dc_bands[i].permille / 10,
+			   sx1278_dc_bands[i].permille % 10,
+			   sx1278_dc_budget(phy, dc, now), dc->deferred);
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(sx1278_dc);
+
+/* IEEE 802.15.4 frame control fields */
+#define SX1278_FC_TYPE			0x0007
+#define SX1278_FC_TYPE_BEACON		0x0000
+#define SX1278_FC_TYPE_DATA		0x0001
+#define SX1278_FC_TYPE_ACK		0x0002
+#define SX1278_FC_ACK_REQ		0x0020
+#define SX1278_FC_PANID_COMP		0x0040
+#define SX1278_FC_DADDR			0x0C00
+#define SX1278_FC_DADDR_SHORT		0x0800
+#define SX1278_FC_DADDR_EXT		0x0C00
+#define SX1278_FC_SADDR_SHORT		0x8000
+/* The broadcast PAN ID and short address */
+#define SX1278_ADDR_BCAST		0xFFFF
+
+/*
+ * In TDMA mode a gateway sends a beacon at the start of each superframe, and
+ * the superframe is divided into the beacon slot and the data slots.  A node
+ * synchronizes to the beacon with its RX done timestamp minus the time-on-air,
+ * and only transmits within its own data slot.  The slot length covers a
+ * maximum frame at the current SF/BW and the polling granularity.  Nobody else
+ * transmits in a node's own slot, so a pending RX is cut off for the TX.
+ */
+
+#define SX1278_TDMA_OFF		0
+#define SX1278_TDMA_GATEWAY	1
+#define SX1278_TDMA_NODE	2
+
+/* Superframes without beacon before a node loses the synchronization */
+#define SX1278_TDMA_LOST	4
+
+static u8 tdma_role = SX1278_TDMA_OFF;
+module_param(tdma_role, byte, 0000);
+MODULE_PARM_DESC(tdma_role, "TDMA role: 0 off, 1 gateway, 2 node");
+
+#ifndef SX1278_TDMA_SLOTS
+#define SX1278_TDMA_SLOTS	8
+#endif
+static u8 tdma_slots = SX1278_TDMA_SLOTS;
+module_param(tdma_slots, byte, 0000);
+MODULE_PARM_DESC(tdma_slots, "TDMA data slots in a superframe");
+
+static u8 tdma_slot = 1;
+module_param(tdma_slot, byte, 0000);
+MODULE_PARM_DESC(tdma_slot, "Own TDMA data slot from 1");
+
+/* The IEEE 802.15.4 beacon frame carrying the superframe structure */
+struct sx1278_tdma_beacon {
+	__le16 fc;
+	u8 seq;
+	__le16 pan_id;
+	__le16 src;
+	__le16 superframe;
+	u8 gts;
+	u8 pending;
+	/* Beacon payload */
+	u8 magic[4];
+	u8 n_slots;
+	__le32 slot_us;
+} __packed;
+
+static const u8 sx1278_tdma_magic[4] = { 'S', 'X', 'T', 'D' };
+
+/**
+ * sx1278_tdma_slot_us - Calculate the TDMA slot length
+ * @phy:	the SX1278 PHY
+ *
+ * Return:	the slot length in us
+ */
+static u32
+sx1278_tdma_slot_us(struct sx1278_phy *phy)
+{
+	u32 tsym = ((u32)1 << phy->mod.sf) * 1000 / (phy->mod.bw / 1000);
+	u32 len = (phy->implicit_len) ? phy->implicit_len : IEEE802154_MTU;
+
+	/* A maximum frame, polling jitter on both sides and 2 symbols. */
+	return sx127X_lora_toa(&phy->mod, len) + 2 * jiffies_to_usecs(1)
+	       + 2 * tsym;
+}
+
+/**
+ * sx1278_tdma_reset - Start TDMA over with the configured role and slots
+ * @phy:	the SX1278 PHY
+ */
+static void
+sx1278_tdma_reset(struct sx1278_phy *phy)
+{
+	struct sx1278_tdma *tdma = &phy->tdma;
+
+	tdma->synced = false;
+	tdma->beacon_tx = false;
+	if (tdma->role == SX1278_TDMA_GATEWAY) {
+		tdma->slot_us = sx1278_tdma_slot_us(phy);
+		/* The first beacon is due at once. */
+		tdma->epoch = ktime_sub_us(ktime_get(),
+					   (u64)(tdma->n_slots + 1) *
+					   tdma->slot_us);
+		tdma->synced = true;
+	}
+}
+
+/**
+ * sx1278_tdma_rx_beacon - Synchronize to the received beacon
+ * @phy:	the SX1278 PHY
+ * @data:	the received frame
+ * @len:	the length of the frame in bytes
+ *
+ * Return:	true / false for a TDMA beacon / others
+ */
+static bool
+sx1278_tdma_rx_beacon(struct sx1278_phy *phy, const u8 *data, size_t len)
+{
+	const struct sx1278_tdma_beacon *b = (const void *)data;
+	struct sx1278_tdma *tdma = &phy->tdma;
+
+	if (len != sizeof(*b) ||
+	    (get_unaligned_le16(&b->fc) & SX1278_FC_TYPE) !=
+	    SX1278_FC_TYPE_BEACON ||
+	    memcmp(b->magic, sx1278_tdma_magic, sizeof(b->magic)))
+		return false;
+
+	if (tdma->role != SX1278_TDMA_NODE)
+		return true;
+
+	/* The superframe starts with the beacon on air. */
+	tdma->epoch = ktime_sub_us(phy->rx_done, phy->rx_meta.toa);
+	tdma->n_slots = b->n_slots;
+	tdma->slot_us = get_unaligned_le32(&b->slot_us);
+	tdma->synced = tdma->n_slots && tdma->slot_us;
+
+	return true;
+}
+
+/**
+ * sx1278_tdma_tx_beacon - Send the beacon of a new superframe
+ * @phy:	the SX1278 PHY
+ * @now:	the current time
+ *
+ * Return:	true / false for the beacon is on air / the radio is busy
+ */
+static bool
+sx1278_tdma_tx_beacon(struct sx1278_phy *phy, ktime_t now)
+{
+	struct sx1278_tdma *tdma = &phy->tdma;
+	struct sx1278_tdma_beacon b;
+
+	if (!sx1278_ieee_hand_over(phy, SX1278_ST_IDLE, SX1278_ST_TX_ACTIVE))
+		return false;
+
+	memset(&b, 0, sizeof(b));
+	put_unaligned_le16(SX1278_FC_TYPE_BEACON | SX1278_FC_SADDR_SHORT,
+			   &b.fc);
+	b.seq = tdma->seq++;
+	put_unaligned_le16(IEEE802154_PANID_BROADCAST, &b.pan_id);
+	put_unaligned_le16(IEEE802154_ADDR_UNDEF, &b.src);
+	/* Beacon and superframe orders 15: no 802.15.4 superframe */
+	put_unaligned_le16(0x00FF, &b.superframe);
+	memcpy(b.magic, sx1278_tdma_magic, sizeof(b.magic));
+	b.n_slots = tdma->n_slots;
+	put_unaligned_le32(tdma->slot_us, &b.slot_us);
+
+	/* The beacon takes over the TX FIFO from the queued frame. */
+	atomic_andnot(SX1278_ST_TX_LOADED, &phy->state);
+	sx1278_ieee_send(phy, (u8 *)&b, sizeof(b));
+	sx1278_dc_charge(phy, sizeof(b));
+	phy->opmode = (phy->opmode & 0xF8) | SX127X_TX_MODE;
+	sx1278_xfer_write_reg(phy->xfer, SX127X_REG_OP_MODE, phy->opmode);
+	tdma->epoch = now;
+	tdma->beacon_tx = true;
+
+	return true;
+}
+
+/**
+ * sx1278_tdma_schedule - Decide the TX in the current TDMA slot
+ * @phy:	the SX1278 PHY
+ * @now:	the current time
+ * @state:	the polled operating state of the device
+ *
+ * A due beacon is sent, and a pending RX is stopped when the own slot has come
+ * for the queued frame.
+ *
+ * Return:	true / false for the queued frame can be sent / hold it
+ */
+static bool
+sx1278_tdma_schedule(struct sx1278_phy *phy, ktime_t now, int *state)
+{
+	struct sx1278_tdma *tdma = &phy->tdma;
+	struct sk_buff *skb = READ_ONCE(phy->tx_buf);
+	u64 sf_us;
+	u64 off;
+	s64 t;
+	u32 toa;
+	bool beacon = false;
+
+	if (!tdma->synced || tdma->beacon_tx)
+		return false;
+
+	sf_us = (u64)(tdma->n_slots + 1) * tdma->slot_us;
+	t = max_t(s64, ktime_us_delta(now, tdma->epoch), 0);
+	if (tdma->role == SX1278_TDMA_GATEWAY) {
+		beacon = (t >= sf_us);
+	} else if (t >= SX1278_TDMA_LOST * sf_us) {
+		dev_dbg(regmap_get_device(phy->map), "%s: lost beacons\n",
+			__func__);
+		tdma->synced = false;
+		return false;
+	}
+
+	if (!beacon) {
+		if (!skb || tdma->slot < 1 || tdma->slot > tdma->n_slots)
+			return false;
+		div64_u64_rem(t, sf_us, &off);
+		toa = sx127X_lora_toa(&phy->mod, (phy->implicit_len) ?
+						 phy->implicit_len : skb->len);
+		if (off < (u64)tdma->slot * tdma->slot_us ||
+		    off + toa >= (u64)(tdma->slot + 1) * tdma->slot_us ||
+		    !sx1278_dc_admit(phy, skb->len))
+			return false;
+	}
+
+	/* The slot is ours, stop waiting for others. */
+	if (*state == SX127X_RXSINGLE_MODE)
+		sx1278_ieee_abort_rx(phy, state);
+
+	if (beacon) {
+		if (*state == SX127X_STANDBY_MODE)
+			sx1278_tdma_tx_beacon(phy, now);
+		return false;
+	}
+
+	return true;
+}
+
+static int
+sx1278_tdma_show(struct seq_file *s, void *data)
+{
+	struct sx1278_phy *phy = s->private;
+	struct sx1278_tdma *tdma = &phy->tdma;
+	static const char * const roles[] = { "off", "gateway", "node" };
+
+	seq_printf(s, "role: %s\n", roles[tdma->role]);
+	seq_printf(s, "slots: %u\n", tdma->n_slots);
+	seq_printf(s, "slot: %u\n", tdma->slot);
+	seq_printf(s, "slot_us: %u\n", tdma->slot_us);
+	seq_printf(s, "synced: %d\n", tdma->synced);
+	seq_printf(s, "epoch: %lld\n", ktime_to_ns(tdma->epoch));
+
+	return 0;
+}
+
+static int
+sx1278_tdma_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, sx1278_tdma_show, inode->i_private);
+}
+
+/*
+ * Write "off", "gateway" or "node" to switch the role, "slots <n>" for the
+ * data slots of a gateway's superframe, or "slot <n>" for the own data slot.
+ */
+static ssize_t
+sx1278_tdma_write(struct file *file, const char __user *ubuf, size_t count,
+		  loff_t *ppos)
+{
+	struct sx1278_phy *phy = file_inode(file)->i_private;
+	struct sx1278_tdma *tdma = &phy->tdma;
+	char buf[32];
+	u8 role;
+	u8 n_slots;
+	u8 slot;
+	u32 v;
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+
+	rtnl_lock();
+	role = tdma->role;
+	n_slots = tdma->n_slots;
+	slot = tdma->slot;
+	if (sysfs_streq(buf, "off")) {
+		role = SX1278_TDMA_OFF;
+	} else if (sysfs_streq(buf, "gateway")) {
+		role = SX1278_TDMA_GATEWAY;
+	} else if (sysfs_streq(buf, "node")) {
+		role = SX1278_TDMA_NODE;
+	} else if (sscanf(buf, "slots %u", &v) == 1 && v > 0 && v < 256) {
+		n_slots = v;
+	} else if (sscanf(buf, "slot %u", &v) == 1 && v > 0 && v < 256) {
+		slot = v;
+	} else {
+		/* A rejected command keeps the beacon synchronization. */
+		rtnl_unlock();
+		return -EINVAL;
+	}
+
+	if (phy->running)
+		sx1278_ieee_pause(phy);
+
+	tdma->role = role;
+	tdma->n_slots = n_slots;
+	tdma->slot = slot;
+	sx1278_tdma_reset(phy);
+
+	if (phy->running)
+		sx1278_ieee_resume_rx(phy);
+	rtnl_unlock();
+
+	return count;
+}
+
+static const struct file_operations sx1278_tdma_fops = {
+	.owner = THIS_MODULE,
+	.open = sx1278_tdma_open,
+	.read = seq_read,
+	.write = sx1278_tdma_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/*
+ * Auto ACK: a frame requesting ACK and addressed to this device is acknowledged
+ * right after its RX done, before it is passed up.  A sent frame requesting
+ * ACK keeps the TX slot and the radio listens for the ACK until the time-out
+ * derived from the airtime.  It is sent again after a random backoff up to the
+ * frame retries, or fails with no ACK.
+ */
+
+#define SX1278_DST_OTHER	0
+#define SX1278_DST_BCAST	1
+#define SX1278_DST_OURS		2
+
+/* Frame control, sequence number, PAN ID and extended destination address */
+#define SX1278_FILT_LEN		13
+
+/* IEEE 802.15.4 ACK frame: frame control and sequence number */
+#define SX1278_ACK_LEN		3
+
+/*
+ * The responder's SPI bytes from its RX done to the ACK on air: the RX length,
+ * the header read, the ACK write and TX mode with their command bytes.
+ */
+#define SX1278_ACK_SPI_LEN	32
+
+/* macMaxFrameRetries default of IEEE 802.15.4 */
+#define SX1278_FRAME_RETRIES	3
+
+static int sx1278_ieee_tx_complete(struct ieee802154_hw *hw);
+
+/**
+ * sx1278_ieee_match_dst - Match the destination of a frame with the device
+ * @phy:	the SX1278 PHY
+ * @data:	the frame
+ * @len:	the length of the frame in bytes
+ *
+ * Return:	SX1278_DST_OURS, SX1278_DST_BCAST or SX1278_DST_OTHER
+ */
+static int
+sx1278_ieee_match_dst(struct sx1278_phy *phy, const u8 *data, size_t len)
+{
+	u16 fc;
+	u16 pan;
+
+	if (len < 3)
+		return SX1278_DST_OTHER;
+
+	fc = get_unaligned_le16(data);
+	switch (fc & SX1278_FC_DADDR) {
+	case SX1278_FC_DADDR_SHORT:
+		if (len < 7)
+			return SX1278_DST_OTHER;
+		pan = get_unaligned_le16(data + 3);
+		if (pan != phy->pan_id && pan != SX1278_ADDR_BCAST)
+			return SX1278_DST_OTHER;
+		if (get_unaligned_le16(data + 5) == SX1278_ADDR_BCAST)
+			return SX1278_DST_BCAST;
+		return (get_unaligned_le16(data + 5) == phy->short_addr) ?
+		       SX1278_DST_OURS : SX1278_DST_OTHER;
+	case SX1278_FC_DADDR_EXT:
+		if (len < SX1278_FILT_LEN)
+			return SX1278_DST_OTHER;
+		pan = get_unaligned_le16(data + 3);
+		if (pan != phy->pan_id && pan != SX1278_ADDR_BCAST)
+			return SX1278_DST_OTHER;
+		return (get_unaligned_le64(data + 5) == phy->ext_addr) ?
+		       SX1278_DST_OURS : SX1278_DST_OTHER;
+	case 0:
+		/* Frames without destination go to the PAN coordinator. */
+		return (phy->pan_coord) ? SX1278_DST_OURS : SX1278_DST_OTHER;
+	default:
+		return SX1278_DST_OTHER;
+	}
+}
 
-#ifndef SX1278_IEEE_CHANNEL_MAX
-#define SX1278_IEEE_CHANNEL_MAX		11
-#endif
-static u8 channel_max = SX1278_IEEE_CHANNEL_MAX;
-module_param(channel_max, byte, 0000);
-MODULE_PARM_DESC(channel_max, "Maximum channel number");
+/**
+ * sx1278_ieee_ack_req - Check whether the frame requests ACK
+ * @data:	the frame
+ * @len:	the length of the frame in bytes
+ *
+ * Return:	true / false for requesting ACK / not
+ */
+static bool
+sx1278_ieee_ack_req(const u8 *data, size_t len)
+{
+	u16 fc;
 
-#ifndef SX1278_IEEE_CENTER_CARRIER_FRQ
-#define SX1278_IEEE_CENTER_CARRIER_FRQ	434000000
-#endif
-static u32 carrier_frq = SX1278_IEEE_CENTER_CARRIER_FRQ;
-module_param(carrier_frq, uint, 0000);
-MODULE_PARM_DESC(carrier_frq, "Center carrier frequency in Hz");
+	if (len < 3)
+		return false;
 
-#ifndef SX1278_IEEE_BANDWIDTH
-#define SX1278_IEEE_BANDWIDTH		500000
-#endif
-static u32 bandwidth = SX1278_IEEE_BANDWIDTH;
-module_param(bandwidth, uint, 0000);
-MODULE_PARM_DESC(bandwidth, "Bandwidth in Hz");
+	fc = get_unaligned_le16(data);
 
-struct rf_frq {
-	u32 carrier;
-	u32 bw;
-	u8 ch_min;
-	u8 ch_max;
-};
+	return (fc & SX1278_FC_ACK_REQ) &&
+	       (fc & SX1278_FC_TYPE) != SX1278_FC_TYPE_ACK &&
+	       (fc & SX1278_FC_TYPE) != SX1278_FC_TYPE_BEACON;
+}
 
-void
-sx1278_ieee_get_rf_config(struct ieee802154_hw *hw, struct rf_frq *rf)
+/**
+ * sx1278_ieee_filter - Filter the received frame by its destination
+ * @phy:	the SX1278 PHY
+ * @data:	the frame, of which the first SX1278_FILT_LEN bytes at most are used
+ * @len:	the length of the frame in bytes
+ *
+ * Beacons and ACKs are always accepted for TDMA and the auto ACK.
+ *
+ * Return:	true / false for accepted / not
+ */
+static bool
+sx1278_ieee_filter(struct sx1278_phy *phy, const u8 *data, size_t len)
 {
-#ifdef CONFIG_OF
-	struct sx1278_phy *phy = hw->priv;
-	struct device_node *of_node = (regmap_get_device(phy->map))->of_node;
-
-	/* Set the LoRa chip's center carrier frequency. */
-	if (of_property_read_u32(of_node, "center-carrier-frq", &rf->carrier))
-		rf->carrier = carrier_frq;
-
-	/* Set the LoRa chip's RF bandwidth. */
-	if (of_property_read_u32(of_node, "rf-bandwidth", &rf->bw))
-		rf->bw = bandwidth;
-
-	/* Set the LoRa chip's min & max RF channel if OF is defined. */
-	if (of_property_read_u8(of_node, "minimal-RF-channel", &rf->ch_min))
-		rf->ch_min = channel_min;
-
-	if (of_property_read_u8(of_node, "maximum-RF-channel", &rf->ch_max))
-		rf->ch_max = channel_max;
-#else
-	rf->carrier = carrier_frq;
-	rf->bw = bandwidth;
-	rf->ch_min = channel_min;
-	rf->ch_max = channel_max;
-#endif
+	u16 type;
+
+	if (len < 3)
+		return false;
+
+	type = get_unaligned_le16(data) & SX1278_FC_TYPE;
+	if (type == SX1278_FC_TYPE_BEACON || type == SX1278_FC_TYPE_ACK)
+		return true;
+
+	return sx1278_ieee_match_dst(phy, data, len) != SX1278_DST_OTHER;
+}
+
+/**
+ * sx1278_ieee_ack_timeout - Calculate the time to wait for an ACK
+ * @phy:	the SX1278 PHY
+ *
+ * Return:	the time-out in us
+ */
+static u32
+sx1278_ieee_ack_timeout(struct sx1278_phy *phy)
+{
+	u32 tsym = ((u32)1 << phy->mod.sf) * 1000 / (phy->mod.bw / 1000);
+	u32 len = (phy->implicit_len) ? phy->implicit_len : SX1278_ACK_LEN;
+	u32 spi;
+
+	/* The responder's SPI clock is taken as ours. */
+	spi = DIV_ROUND_UP(SX1278_ACK_SPI_LEN * 8 * USEC_PER_SEC,
+			   phy->xfer->spi->max_speed_hz);
+
+	/* ACK's airtime, both sides' polling, responder's SPI and 2 symbols */
+	return sx127X_lora_toa(&phy->mod, len) + 3 * jiffies_to_usecs(1)
+	       + spi + 2 * tsym;
+}
+
+/**
+ * sx1278_ieee_tx_ack - Acknowledge the received frame
+ * @phy:	the SX1278 PHY
+ * @seq:	the sequence number of the received frame
+ *
+ * The device is in standby state after the single RX done.  The TX FIFO does
+ * not overlap the received frame, so the rest of it can be read while the ACK
+ * is on air.
+ */
+static void
+sx1278_ieee_tx_ack(struct sx1278_phy *phy, u8 seq)
+{
+	u8 ack[SX1278_ACK_LEN];
+
+	if (!sx1278_ieee_hand_over(phy, SX1278_ST_RX_ARMED,
+				   SX1278_ST_TX_ACTIVE))
+		return;
+
+	put_unaligned_le16(SX1278_FC_TYPE_ACK, ack);
+	ack[2] = seq;
+	/* The ACK takes over the TX FIFO from the queued frame. */
+	atomic_andnot(SX1278_ST_TX_LOADED, &phy->state);
+	sx1278_ieee_send(phy, ack, sizeof(ack));
+	sx1278_dc_charge(phy, sizeof(ack));
+	phy->opmode = (phy->opmode & 0xF8) | SX127X_TX_MODE;
+	sx1278_xfer_write_reg(phy->xfer, SX127X_REG_OP_MODE, phy->opmode);
+	phy->ack_tx = true;
 }
 
 static int
-sx1278_ieee_set_channel(struct ieee802154_hw *hw, u8 page, u8 channel)
+sx1278_ieee_set_hw_addr_filt(struct ieee802154_hw *hw,
+			     struct ieee802154_hw_addr_filt *filt,
+			     unsigned long changed)
 {
 	struct sx1278_phy *phy = hw->priv;
-	struct rf_frq rf;
-	u32 fr;
-	s8 d;
 
-	dev_dbg(regmap_get_device(phy->map),
-		"%s channel: %u\n", __func__, channel);
+	dev_dbg(regmap_get_device(phy->map), "%s: changed 0x%lX\n",
+		__func__, changed);
+
+	if (changed & IEEE802154_AFILT_SADDR_CHANGED)
+		phy->short_addr = le16_to_cpu(filt->short_addr);
+	if (changed & IEEE802154_AFILT_PANID_CHANGED)
+		phy->pan_id = le16_to_cpu(filt->pan_id);
+	if (changed & IEEE802154_AFILT_IEEEADDR_CHANGED)
+		phy->ext_addr = le64_to_cpu(filt->ieee_addr);
+	if (changed & IEEE802154_AFILT_PANC_CHANGED)
+		phy->pan_coord = filt->pan_coord;
 
-	sx1278_ieee_get_rf_config(hw, &rf);
+	return 0;
+}
 
-	if (channel < rf.ch_min)
-		channel = rf.ch_min;
-	else if (channel > rf.ch_max)
-		channel = rf.ch_max;
+static int
+sx1278_filter_show(struct seq_file *s, void *data)
+{
+	struct sx1278_phy *phy = s->private;
 
-	d = channel - (rf.ch_min + rf.ch_max) / 2;
-	fr = rf.carrier + d * rf.bw;
+	seq_printf(s, "promiscuous: %d\n", phy->promiscuous);
+	seq_printf(s, "pan_id: 0x%04x\n", phy->pan_id);
+	seq_printf(s, "short_addr: 0x%04x\n", phy->short_addr);
+	seq_printf(s, "ext_addr: 0x%016llx\n", phy->ext_addr);
+	seq_printf(s, "pan_coord: %d\n", phy->pan_coord);
+	seq_printf(s, "filtered: %u\n", phy->filtered);
 
-	sx127X_set_lorafrq(phy->map, fr);
-	phy->opmode = sx127X_get_mode(phy->map);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(sx1278_filter);
+
+static int
+sx1278_ieee_set_frame_retries(struct ieee802154_hw *hw, s8 retries)
+{
+	struct sx1278_phy *phy = hw->priv;
+
+	dev_dbg(regmap_get_device(phy->map), "%s: %d\n", __func__, retries);
+
+	phy->frame_retries = max_t(s8, retries, 0);
 
 	return 0;
 }
 
-/* in mbm */
-s32 sx1278_powers[] = {
-	-200, -100, 0, 100, 200, 300, 400, 500, 600, 700, 800, 900, 1000, 1100,
-	1200, 1300, 1400, 1500, 1600, 1700, 1800, 1900, 2000, 2100, 2200, 2300};
+/**
+ * sx1278_ieee_wait_ack - Listen for the ACK of the sent frame
+ * @phy:	the SX1278 PHY
+ * @now:	the time of TX done
+ *
+ * The frame keeps the TX slot, but the radio is released for the reception.
+ */
+static void
+sx1278_ieee_wait_ack(struct sx1278_phy *phy, ktime_t now)
+{
+	struct sk_buff *skb = READ_ONCE(phy->tx_buf);
+
+	sx1278_ieee_hand_over(phy, SX1278_ST_TX_ACTIVE, SX1278_ST_IDLE);
+	phy->ack_seq = skb->data[2];
+	phy->ack_deadline = ktime_add_us(now, sx1278_ieee_ack_timeout(phy));
+	phy->ack_wait = true;
+}
+
+/**
+ * sx1278_ieee_check_ack - Check the time-out of the frame waiting for its ACK
+ * @phy:	the SX1278 PHY
+ * @now:	the time of this polling
+ * @state:	the operation mode of the chip, updated if RX is stopped
+ *
+ * After the time-out the frame is sent again after a random backoff, or fails
+ * with no ACK once the frame retries are used up.  RX is left stopped, so the
+ * caller arms it again for the backoff or the next frame.
+ *
+ * Return:	true / false for still waiting / not
+ */
+static bool
+sx1278_ieee_check_ack(struct sx1278_phy *phy, ktime_t now, int *state)
+{
+	struct sk_buff *skb = READ_ONCE(phy->tx_buf);
+
+	if (ktime_before(now, phy->ack_deadline))
+		return true;
+
+	/* Stop listening, or wait for the ACK being sent to another device. */
+	if (!sx1278_ieee_abort_rx(phy, state) &&
+	    (atomic_read(&phy->state) & SX1278_ST_OWNER) != SX1278_ST_IDLE)
+		return true;
+
+	phy->ack_wait = false;
+	phy->burst_us = 0;
+	/* The received frames may have overwritten the FIFO. */
+	atomic_andnot(SX1278_ST_TX_LOADED, &phy->state);
+
+	if (phy->retries < phy->frame_retries) {
+		phy->retries++;
+		phy->tx_delay = 1 + get_random_u32_below(8 << min_t(u8,
+							phy->retries, 4));
+		dev_dbg(regmap_get_device(phy->map), "%s: retry %u seq %u\n",
+			__func__, phy->retries, phy->ack_seq);
+		return false;
+	}
+
+	dev_dbg(regmap_get_device(phy->map), "%s: no ACK of seq %u\n",
+		__func__, phy->ack_seq);
+	phy->retries = 0;
+	WRITE_ONCE(phy->tx_buf, NULL);
+	ieee802154_xmit_error(phy->hw, skb, IEEE802154_NO_ACK);
+
+	return false;
+}
 
 static int
-sx1278_ieee_set_txpower(struct ieee802154_hw *hw, s32 mbm)
+sx1278_ieee_rx_complete(struct ieee802154_hw *hw)
 {
 	struct sx1278_phy *phy = hw->priv;
-	s32 dbm = sx127X_mbm2dbm(mbm);
+	struct sx1278_xfer *x = phy->xfer;
+	struct sk_buff *skb = NULL;
+	const u8 *data;
+	ssize_t len;
+	ssize_t hlen;
+	ssize_t got = 0;
+	int flen;
+	bool pass;
+	int err;
+
+	len = sx1278_xfer_read_reg(x, SX127X_REG_RX_NB_BYTES);
+	if (len < 0) {
+		err = len;
+		goto sx1278_ieee_rx_err;
+	}
+
+	/* The head of the frame may have been streamed while on air. */
+	if (phy->rx_ct.active && phy->rx_ct.len == len) {
+		got = phy->rx_ct.got;
+		skb = phy->rx_ct.skb;
+		phy->rx_ct.skb = NULL;
+	}
+	sx1278_ieee_rx_ct_reset(phy);
+
+	/* Only the header is needed to filter the frame. */
+	hlen = (phy->implicit_len) ? SX1278_FILT_LEN + 1 : SX1278_FILT_LEN;
+	hlen = min_t(ssize_t, len, hlen);
+	if (hlen > got) {
+		got = sx1278_xfer_read_fifo(x, got, hlen);
+		if (got < 0) {
+			err = got;
+			goto sx1278_ieee_rx_free;
+		}
+	}
+
+	data = x->fifo_in;
+	flen = len;
+	if (phy->implicit_len) {
+		flen = sx1278_ieee_implicit_frame(data, len);
+		if (flen < 0) {
+			err = flen;
+			goto sx1278_ieee_rx_free;
+		}
+		data++;
+	} else if (len > IEEE802154_MTU) {
+		err = -EINVAL;
+		goto sx1278_ieee_rx_free;
+	}
+
+	/* Frames addressed elsewhere are read on only for the capture. */
+	pass = phy->promiscuous || sx1278_ieee_filter(phy, data, flen);
+
+	/* Acknowledge from the header already for a short round trip. */
+	if (!phy->promiscuous && sx1278_ieee_ack_req(data, flen) &&
+	    sx1278_ieee_match_dst(phy, data, flen) == SX1278_DST_OURS)
+		sx1278_ieee_tx_ack(phy, data[2]);
+	sx1278_ieee_rx_meta(phy, len);
+
+	/* Only the tail is left after the cut-through RX. */
+	if ((pass || sx1278_cap_active(phy)) && len > got) {
+		len = sx1278_xfer_read_fifo(x, got, len);
+		if (len < 0) {
+			err = len;
+			goto sx1278_ieee_rx_free;
+		}
+	}
+
+	/* The retune goes through sleep, so it is queued for an idle point. */
+	if (phy->cfg.afc)
+		sx1278_ieee_afc(phy);
+
+	if (!pass && !sx1278_cap_active(phy)) {
+		phy->filtered++;
+		err = 0;
+		goto sx1278_ieee_rx_free;
+	}
+
+	if (!skb)
+		skb = dev_alloc_skb(IEEE802154_MTU);
+	if (!skb) {
+		err = -ENOMEM;
+		dev_err(regmap_get_device(phy->map),
+			"%s: driver is out of memory\n", __func__);
+		goto sx1278_ieee_rx_err;
+	}
+	skb_put_data(skb, data, flen);
+
+	skb_hwtstamps(skb)->hwtstamp = phy->rx_meta.tstamp;
+	skb->tstamp = phy->rx_meta.tstamp;
+
+	if (sx1278_cap_active(phy))
+		sx1278_cap_record(phy, skb->data, skb->len, false);
+
+	if (!pass) {
+		phy->filtered++;
+		err = 0;
+		goto sx1278_ieee_rx_free;
+	}
+
+	/* The ACK of the frame waiting for it */
+	if (skb->len >= 2 &&
+	    (get_unaligned_le16(skb->data) & SX1278_FC_TYPE) ==
+	    SX1278_FC_TYPE_ACK) {
+		if (phy->ack_wait && skb->len == SX1278_ACK_LEN &&
+		    skb->data[2] == phy->ack_seq) {
+			phy->ack_wait = false;
+			sx1278_ieee_tx_complete(hw);
+		}
+		err = 0;
+		goto sx1278_ieee_rx_free;
+	}
+
+	/* The TDMA beacons are consumed by the driver. */
+	if (sx1278_tdma_rx_beacon(phy, skb->data, skb->len)) {
+		err = 0;
+		goto sx1278_ieee_rx_free;
+	}
 
 	dev_dbg(regmap_get_device(phy->map),
-		"%s TX power: %d mbm\n", __func__, mbm);
+		"%s: len=%u LQI=%u RSSI=%d SNR=%d FEI=%d\n", __func__,
+		skb->len, phy->rx_meta.lqi, phy->rx_meta.rssi,
+		phy->rx_meta.snr / 4, phy->rx_meta.fei);
 
-	sx127X_set_lorapower(phy->map, dbm);
+	ieee802154_rx_irqsafe(hw, skb, phy->rx_meta.lqi);
+	skb = NULL;
 
-	return 0;
+	err = 0;
+
+sx1278_ieee_rx_free:
+	kfree_skb(skb);
+sx1278_ieee_rx_err:
+	sx1278_ieee_hand_over(phy, SX1278_ST_RX_ARMED, SX1278_ST_IDLE);
+	return err;
+}
+
+/* Stream the payload from the RX FIFO after the valid header */
+static bool cut_through = true;
+module_param(cut_through, bool, 0000);
+MODULE_PARM_DESC(cut_through, "Read the RX FIFO while the payload is on air");
+
+/**
+ * sx1278_ieee_rx_stream - Read the payload on air after the valid header
+ * @phy:	the SX1278 PHY
+ *
+ * The payload is read from the RX FIFO up to the byte which the receiver is
+ * writing, so only the tail is left to read after RX done.  The skb is
+ * allocated with the header's length.  A frame addressed elsewhere stops
+ * streaming after its header, unless it is going to be captured.
+ */
+static void
+sx1278_ieee_rx_stream(struct sx1278_phy *phy)
+{
+	struct sx1278_rx_ct *ct = &phy->rx_ct;
+	struct sx1278_xfer *x = phy->xfer;
+	ssize_t len;
+	int adr;
+
+	/* Only the explicit header has the payload length. */
+	if (!cut_through || phy->implicit_len)
+		return;
+
+	if (!ct->active) {
+		len = sx1278_xfer_read_reg(x, SX127X_REG_RX_NB_BYTES);
+		if (len <= 0 || len > IEEE802154_MTU)
+			return;
+		ct->skb = dev_alloc_skb(len);
+		if (!ct->skb)
+			return;
+		ct->len = len;
+		ct->got = 0;
+		ct->skip = false;
+		ct->active = true;
+	}
+
+	if (ct->skip || ct->got >= ct->len)
+		return;
+
+	/* The byte being written is left for the next polling. */
+	adr = sx1278_xfer_read_reg(x, SX127X_REG_FIFO_RX_BYTE_ADDR);
+	if (adr < 0)
+		return;
+	len = min_t(ssize_t, adr - SX127X_FIFO_RX_BASE_ADDRESS, ct->len);
+	if (len <= ct->got)
+		return;
+
+	len = sx1278_xfer_read_fifo(x, ct->got, len);
+	if (len < 0)
+		return;
+	ct->got = len;
+
+	if (ct->got >= min_t(u8, ct->len, SX1278_FILT_LEN) &&
+	    !phy->promiscuous && !sx1278_cap_active(phy) &&
+	    !sx1278_ieee_filter(phy, x->fifo_in, ct->len))
+		ct->skip = true;
+}
+
+/**
+ * sx1278_ieee_rx_capture_bad - Capture the received frame with CRC error
+ * @hw:		LoRa IEEE 802.15.4 device
+ *
+ * The frame is not passed to the IEEE 802.15.4 stack, but only captured in
+ * monitor mode for debugging.
+ */
+static void
+sx1278_ieee_rx_capture_bad(struct ieee802154_hw *hw)
+{
+	struct sx1278_phy *phy = hw->priv;
+	u8 *buf = phy->xfer->fifo_in;
+	u8 *data = buf;
+	ssize_t len;
+	int flen;
+
+	len = sx1278_xfer_read_reg(phy->xfer, SX127X_REG_RX_NB_BYTES);
+	if (len >= 0)
+		len = sx1278_xfer_read_fifo(phy->xfer, 0, len);
+	if (len < 0)
+		return;
+
+	sx1278_ieee_rx_meta(phy, len);
+
+	if (phy->implicit_len) {
+		flen = sx1278_ieee_implicit_frame(buf, len);
+		if (flen < 0)
+			return;
+		data = buf + 1;
+		len = flen;
+	}
+
+	sx1278_cap_record(phy, data, len, true);
 }
 
 int
-sx1278_ieee_rx(struct ieee802154_hw *hw)
+sx1278_ieee_tx(struct ieee802154_hw *hw)
 {
 	struct sx1278_phy *phy = hw->priv;
-	bool do_rx;
-	unsigned long f;
+	struct sk_buff *tx_buf = READ_ONCE(phy->tx_buf);
 
-	dev_dbg(regmap_get_device(phy->map), "%s\n", __func__);
+	dev_dbg(regmap_get_device(phy->map),
+		"%s: len=%u\n", __func__, tx_buf->len);
 
-	spin_lock_irqsave(&phy->buf_lock, f);
-	if (!phy->is_busy) {
-		phy->is_busy = true;
-		do_rx = true;
-	} else {
-		do_rx = false;
+	if (!(atomic_read(&phy->state) & SX1278_ST_TX_LOADED) &&
+	    sx1278_ieee_hand_over(phy, SX1278_ST_IDLE, SX1278_ST_TX_LOADING)) {
+		sx1278_ieee_send(phy, tx_buf->data, tx_buf->len);
+		atomic_or(SX1278_ST_TX_LOADED, &phy->state);
+		sx1278_ieee_hand_over(phy, SX1278_ST_TX_LOADING,
+				      SX1278_ST_IDLE);
 	}
-	spin_unlock_irqrestore(&phy->buf_lock, f);
 
-	if (do_rx) {
-		sx127X_set_state(phy->map, SX127X_RXSINGLE_MODE);
+	if (sx1278_ieee_hand_over(phy, SX1278_ST_IDLE, SX1278_ST_TX_ACTIVE)) {
+		/* Set chip as TX state and transfer the data in FIFO. */
+		phy->opmode = (phy->opmode & 0xF8) | SX127X_TX_MODE;
+		sx1278_xfer_write_reg(phy->xfer, SX127X_REG_OP_MODE,
+				      phy->opmode);
+		phy->tx_start = ktime_get_real();
+		sx1278_dc_charge(phy, tx_buf->len);
+		skb_tx_timestamp(tx_buf);
 		return 0;
 	} else {
 		dev_dbg(regmap_get_device(phy->map),
@@ -1223,140 +4438,440 @@ sx1278_ieee_rx(struct ieee802154_hw *hw)
 	}
 }
 
+/**
+ * sx1278_ieee_xmit_done - Pass the sent frame back to the stack
+ * @hw:		LoRa IEEE 802.15.4 device
+ * @skb:	the sent frame
+ *
+ * mac802154 releases its queue, and the TX softirq raised for it runs when the
+ * BHs are enabled again.  So the stack's next frame is usually in the TX slot
+ * on the return.
+ */
+static void
+sx1278_ieee_xmit_done(struct ieee802154_hw *hw, struct sk_buff *skb)
+{
+	KUNIT_STATIC_STUB_REDIRECT(sx1278_ieee_xmit_done, hw, skb);
+
+	local_bh_disable();
+	ieee802154_xmit_complete(hw, skb, false);
+	local_bh_enable();
+}
+
 static int
-sx1278_ieee_rx_complete(struct ieee802154_hw *hw)
+sx1278_ieee_tx_complete(struct ieee802154_hw *hw)
+{
+	struct sx1278_phy *phy = hw->priv;
+	struct sk_buff *skb = phy->tx_buf;
+	struct skb_shared_hwtstamps hwts;
+	u32 toa;
+
+	dev_dbg(regmap_get_device(phy->map), "%s\n", __func__);
+
+	/* The end of the frame is the TX start plus the time-on-air. */
+	if (skb_shinfo(skb)->tx_flags & SKBTX_HW_TSTAMP) {
+		toa = sx127X_lora_toa(&phy->mod, (phy->implicit_len) ?
+						 phy->implicit_len : skb->len);
+		memset(&hwts, 0, sizeof(hwts));
+		hwts.hwtstamp = ktime_add_ns(phy->tx_start,
+					     (u64)toa * NSEC_PER_USEC);
+		skb_tstamp_tx(skb, &hwts);
+	}
+
+	/* Release the radio and TX slot before the next frame is queued. */
+	phy->retries = 0;
+	atomic_set(&phy->state, SX1278_ST_IDLE);
+	WRITE_ONCE(phy->tx_buf, NULL);
+	sx1278_ieee_xmit_done(hw, skb);
+
+	return 0;
+}
+
+/*
+ * mac802154 holds its queue until the frame in the TX slot is done, so the
+ * next frames wait in the qdisc of the wpan interface, which decides their
+ * order.
+ */
+
+static int
+sx1278_ieee_xmit(struct ieee802154_hw *hw, struct sk_buff *skb)
 {
 	struct sx1278_phy *phy = hw->priv;
+
+	dev_dbg(regmap_get_device(phy->map), "%s\n", __func__);
+
+	WARN_ON(phy->suspended);
+
+	/* The TX slot holds one frame until its TX done. */
+	if (cmpxchg(&phy->tx_buf, NULL, skb))
+		return -EBUSY;
+
+	return 0;
+}
+
+/*
+ * A train of frames, like 6LoWPAN fragments, is sent back to back.  The stack
+ * passes its next frame on the completion of the previous one, at the TX done
+ * or at its ACK, and the TX of the next frame starts right away without the RX
+ * window in between.  The burst ends when the stack has no frame waiting or
+ * the burst has taken burst_airtime.
+ */
+
+#ifndef SX1278_IEEE_BURST_AIRTIME
+#define SX1278_IEEE_BURST_AIRTIME	1000
+#endif
+static u32 burst_airtime = SX1278_IEEE_BURST_AIRTIME;
+module_param(burst_airtime, uint, 0000);
+MODULE_PARM_DESC(burst_airtime, "Max airtime in ms of a TX burst, 0 for none");
+
+/**
+ * sx1278_ieee_burst - Send the next frame right after the completed one
+ * @phy:	the SX1278 PHY
+ *
+ * TDMA keeps its slots, so there is no burst.
+ *
+ * Return:	true / false for the next TX started / the burst is over
+ */
+static bool
+sx1278_ieee_burst(struct sx1278_phy *phy)
+{
 	struct sk_buff *skb;
-	u8 len;
-	u8 lqi;
-	s32 rssi;
-	s32 range = SX1278_IEEE_ENERGY_RANGE;
-	int err;
-	unsigned long f;
+	u32 next;
 
-	skb = dev_alloc_skb(IEEE802154_MTU);
-	if (!skb) {
-		err = -ENOMEM;
-		dev_err(regmap_get_device(phy->map),
-			"%s: driver is out of memory\n", __func__);
-		goto sx1278_ieee_rx_err;
+	if (!burst_airtime || phy->tdma.role != SX1278_TDMA_OFF)
+		goto sx1278_ieee_burst_end;
+
+	skb = READ_ONCE(phy->tx_buf);
+	if (!skb)
+		goto sx1278_ieee_burst_end;
+
+	next = sx127X_lora_toa(&phy->mod, (phy->implicit_len) ?
+					  phy->implicit_len : skb->len);
+	if (phy->burst_us + next > burst_airtime * USEC_PER_MSEC ||
+	    !sx1278_dc_admit(phy, skb->len) ||
+	    sx1278_ieee_tx(phy->hw))
+		goto sx1278_ieee_burst_end;
+
+	return true;
+
+sx1278_ieee_burst_end:
+	phy->burst_us = 0;
+	return false;
+}
+
+/*
+ * The channel scan hops FRF over the available channels in standby state,
+ * which avoids going through sleep state for each channel, and averages the
+ * RSSI samples of each channel.  The result is the channel occupancy table in
+ * debugfs "scan".  Writing the file scans again.
+ */
+
+#ifndef SX1278_IEEE_SCAN_SAMPLES
+#define SX1278_IEEE_SCAN_SAMPLES	32
+#endif
+static u32 scan_samples = SX1278_IEEE_SCAN_SAMPLES;
+module_param(scan_samples, uint, 0000);
+MODULE_PARM_DESC(scan_samples, "RSSI samples averaged for each channel");
+
+static bool auto_channel;
+module_param(auto_channel, bool, 0000);
+MODULE_PARM_DESC(auto_channel, "Pick the least busy channel at interface up");
+
+/**
+ * sx1278_ieee_scan - Scan the energy of all the available channels
+ * @hw:		LoRa IEEE 802.15.4 device
+ *
+ * Nothing may own the radio.  The device is left in standby state on the
+ * current channel.
+ *
+ * Return:	the least busy channel
+ */
+static struct sx1278_chan *
+sx1278_ieee_scan(struct ieee802154_hw *hw)
+{
+	struct sx1278_phy *phy = hw->priv;
+	struct sx1278_chan *best = phy->chan;
+	struct sx1278_chan *chan;
+	s32 best_rssi = S32_MAX;
+	u32 settle = sx1278_ieee_settle_us(phy);
+	u16 i;
+
+	phy->opmode = (phy->opmode & 0xF8) | SX127X_STANDBY_MODE;
+	sx127X_set_mode(phy->map, phy->opmode);
+
+	for (i = 0; i < phy->n_chans; i++) {
+		chan = &phy->chans[i];
+		/* Hopping stays in the low / high frequency band. */
+		chan->scanned = (chan->frq < 779000000) ==
+				(phy->frq < 779000000);
+		if (!chan->scanned)
+			continue;
+
+		sx127X_hop_lorafrf(phy->map, chan->frf + phy->afc_frf);
+		sx127X_set_mode(phy->map, (phy->opmode & 0xF8)
+					  | SX127X_RXCONTINUOUS_MODE);
+		usleep_range(settle, settle + 100);
+		chan->rssi = sx1278_ieee_sample_rssi(phy, scan_samples,
+						     &chan->peak);
+		sx127X_set_mode(phy->map, phy->opmode);
+
+		if (chan->rssi < best_rssi) {
+			best_rssi = chan->rssi;
+			best = chan;
+		}
+	}
+
+	/* Go back to the current channel. */
+	sx127X_hop_lorafrf(phy->map, phy->chan->frf + phy->afc_frf);
+	phy->scan_time = ktime_get_real();
+
+	return best;
+}
+
+static int
+sx1278_scan_show(struct seq_file *s, void *data)
+{
+	struct sx1278_phy *phy = s->private;
+	struct sx1278_chan *chan;
+	u16 i;
+
+	seq_printf(s, "time: %lld\n", ktime_to_ns(phy->scan_time));
+	seq_puts(s, "page\tchannel\tfrequency\trssi\tpeak\n");
+	for (i = 0; i < phy->n_chans; i++) {
+		chan = &phy->chans[i];
+		if (!chan->scanned)
+			continue;
+		seq_printf(s, "%u\t%u\t%u\t%d\t%d\n", chan->page,
+			   chan->channel, chan->frq, chan->rssi, chan->peak);
 	}
 
-	len = sx127X_get_loralastpktpayloadlen(phy->map);
-	sx127X_readloradata(phy->map, skb_put(skb, len), len);
+	return 0;
+}
 
-	/* LQI: IEEE  802.15.4-2011 8.2.6 Link quality indicator. */
-	rssi = sx127X_get_loralastpktrssi(phy->map);
-	rssi = (rssi > 0) ? 0 : rssi;
-	lqi = ((s32)255 * (rssi + range) / range) % 255;
+static int
+sx1278_scan_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, sx1278_scan_show, inode->i_private);
+}
 
-	ieee802154_rx_irqsafe(hw, skb, lqi);
+static ssize_t
+sx1278_scan_write(struct file *file, const char __user *ubuf, size_t count,
+		  loff_t *ppos)
+{
+	struct sx1278_phy *phy = file_inode(file)->i_private;
+	int ret;
 
-	dev_dbg(regmap_get_device(phy->map),
-		"%s: len=%u LQI=%u\n", __func__, len, lqi);
+	if (!READ_ONCE(phy->running))
+		return -ENETDOWN;
 
-	err = 0;
+	/* The state machine scans at its next idle point. */
+	ret = sx1278_ieee_request(phy, SX1278_REQ_SCAN);
 
-sx1278_ieee_rx_err:
-	spin_lock_irqsave(&phy->buf_lock, f);
-	phy->is_busy = false;
-	spin_unlock_irqrestore(&phy->buf_lock, f);
-	return err;
+	return (ret) ? ret : count;
 }
 
-int
-sx1278_ieee_tx(struct ieee802154_hw *hw)
-{
-	struct sx1278_phy *phy = hw->priv;
-	struct sk_buff *tx_buf = phy->tx_buf;
-	bool do_tx = false;
-	unsigned long f;
+static const struct file_operations sx1278_scan_fops = {
+	.owner = THIS_MODULE,
+	.open = sx1278_scan_open,
+	.read = seq_read,
+	.write = sx1278_scan_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
 
-	dev_dbg(regmap_get_device(phy->map),
-		"%s: len=%u\n", __func__, tx_buf->len);
+/**
+ * sx1278_ieee_do_req - Apply the queued configuration requests in one batch
+ * @phy:	the SX1278 PHY
+ *
+ * Nothing may own the radio.  The device is left in standby state, and the
+ * queued frame is loaded again, since retuning goes through sleep state.
+ */
+static void
+sx1278_ieee_do_req(struct sx1278_phy *phy)
+{
+	struct sx1278_chan *chan;
+	s32 dbm;
+	u8 req;
 
-	if (!phy->post_tx_done) {
-		sx127X_sendloradata(phy->map, tx_buf->data, tx_buf->len);
-		phy->post_tx_done = true;
-	}
+	spin_lock(&phy->req_lock);
+	req = phy->req_pending;
+	chan = phy->req_chan;
+	dbm = phy->req_dbm;
+	phy->req_pending = 0;
+	phy->req_busy = req;
+	spin_unlock(&phy->req_lock);
 
-	spin_lock_irqsave(&phy->buf_lock, f);
-	if (!phy->is_busy) {
-		phy->is_busy = true;
-		do_tx = true;
-		phy->one_to_be_sent = false;
-	}
-	spin_unlock_irqrestore(&phy->buf_lock, f);
+	if (!req)
+		return;
 
-	if (do_tx) {
-		/* Set chip as TX state and transfer the data in FIFO. */
-		phy->opmode = (phy->opmode & 0xF8) | SX127X_TX_MODE;
-		regmap_write_async(phy->map, SX127X_REG_OP_MODE, phy->opmode);
-		return 0;
-	} else {
-		dev_dbg(regmap_get_device(phy->map),
-			"%s: device is busy\n", __func__);
-		return -EBUSY;
+	phy->opmode = (phy->opmode & 0xF8) | SX127X_STANDBY_MODE;
+	sx127X_set_mode(phy->map, phy->opmode);
+
+	if (req & SX1278_REQ_CHANNEL)
+		sx1278_ieee_tune(phy, chan);
+	else if (req & SX1278_REQ_AFC)
+		sx127X_set_lorafrf(phy->map, phy->chan->frf + phy->afc_frf,
+				   phy->frq);
+	if (req & SX1278_REQ_TXPOWER)
+		sx127X_set_lorapower(phy->map, dbm);
+	if (req & SX1278_REQ_ED) {
+		sx127X_set_mode(phy->map, (phy->opmode & 0xF8)
+					  | SX127X_RXCONTINUOUS_MODE);
+		usleep_range(sx1278_ieee_settle_us(phy),
+			     sx1278_ieee_settle_us(phy) + 100);
+		phy->req_rssi = sx1278_ieee_sample_rssi(phy,
+							SX1278_IEEE_ED_SAMPLES,
+							NULL);
+		sx127X_set_mode(phy->map, phy->opmode);
 	}
+	if (req & SX1278_REQ_SCAN)
+		sx1278_ieee_scan(phy->hw);
+	atomic_andnot(SX1278_ST_TX_LOADED, &phy->state);
+
+	spin_lock(&phy->req_lock);
+	phy->req_busy = 0;
+	spin_unlock(&phy->req_lock);
+	wake_up_interruptible(&phy->req_wq);
 }
 
-static int
-sx1278_ieee_tx_complete(struct ieee802154_hw *hw)
+/**
+ * sx1278_ieee_idle_req - Apply the queued configuration requests when idle
+ * @phy:	the SX1278 PHY
+ * @state:	the operating mode of the chip, updated to standby
+ *
+ * The radio is idle without an ACK or beacon exchange, a TX, or a reception
+ * which has detected a preamble.  An idle reception is stopped for the batch.
+ *
+ * Return:	true / false for applied / not idle yet
+ */
+static bool
+sx1278_ieee_idle_req(struct sx1278_phy *phy, int *state)
 {
-	struct sx1278_phy *phy = hw->priv;
-	struct sk_buff *skb = phy->tx_buf;
-	unsigned long f;
+	int owner;
 
-	dev_dbg(regmap_get_device(phy->map), "%s\n", __func__);
+	if (!READ_ONCE(phy->req_pending) || phy->ack_wait || phy->ack_tx ||
+	    phy->tdma.beacon_tx)
+		return false;
 
-	ieee802154_xmit_complete(hw, skb, false);
+	owner = atomic_read(&phy->state) & SX1278_ST_OWNER;
+	if (owner != SX1278_ST_IDLE && !sx1278_ieee_preempt_rx(phy, state))
+		return false;
 
-	spin_lock_irqsave(&phy->buf_lock, f);
-	phy->is_busy = false;
-	phy->tx_buf = NULL;
-	spin_unlock_irqrestore(&phy->buf_lock, f);
+	sx1278_ieee_do_req(phy);
+	*state = SX127X_STANDBY_MODE;
 
-	return 0;
+	return true;
 }
 
-static int
-sx1278_ieee_xmit(struct ieee802154_hw *hw, struct sk_buff *skb)
+/**
+ * sx1278_ieee_init_radio - Configure the LoRa device from scratch
+ * @hw:		LoRa IEEE 802.15.4 device
+ */
+static void
+sx1278_ieee_init_radio(struct ieee802154_hw *hw)
 {
 	struct sx1278_phy *phy = hw->priv;
-	int ret;
-	unsigned long f;
 
-	dev_dbg(regmap_get_device(phy->map), "%s\n", __func__);
+	sx127X_start_loramode(phy->map, phy->cfg.sprf, phy->cfg.rx_timeout);
+	/* The channel's bandwidth is a LoRa register, so tune in LoRa mode. */
+	sx127X_get_loramod(phy->map, &phy->mod);
+	sx1278_ieee_set_channel(hw, hw->phy->current_page,
+				hw->phy->current_channel);
+	sx127X_set_boost(phy->map, phy->cfg.pa_boost);
+	sx127X_set_lorapower(phy->map,
+			     sx127X_mbm2dbm(hw->phy->transmit_power));
+	sx127X_get_loramod(phy->map, &phy->mod);
+	if (phy->mod.implicit) {
+		/* SF6 has only implicit header mode with fixed length. */
+		phy->implicit_len = SX1278_IEEE_IMPLICIT_LEN;
+		regmap_raw_write(phy->map, SX127X_REG_PAYLOAD_LENGTH,
+				 &phy->implicit_len, 1);
+	} else {
+		phy->implicit_len = 0;
+	}
+	phy->configured = true;
+}
 
-	WARN_ON(phy->suspended);
+/**
+ * sx1278_ieee_save - Save the radio state and put the LoRa device to sleep
+ * @phy:	the SX1278 PHY
+ *
+ * The polling is stopped.  A frame in the middle of transmitting will be sent
+ * again after the radio is restored.
+ */
+static void
+sx1278_ieee_save(struct sx1278_phy *phy)
+{
+	sx1278_ieee_pause(phy);
 
-	spin_lock_irqsave(&phy->buf_lock, f);
-	if (phy->tx_buf) {
-		ret = -EBUSY;
-	} else {
-		phy->tx_buf = skb;
-		phy->one_to_be_sent = true;
-		phy->post_tx_done = false;
-		ret = 0;
+	if (phy->pm_asleep)
+		return;
+
+	/* The queued requests go into the saved state. */
+	sx1278_ieee_do_req(phy);
+	if (phy->configured)
+		phy->pm_valid = !sx127X_save_config(phy->map, phy->pm_regs);
+	sx127X_set_state(phy->map, SX127X_SLEEP_MODE);
+	phy->pm_asleep = true;
+}
+
+/**
+ * sx1278_ieee_restore - Restore the radio state saved by sx1278_ieee_save
+ * @phy:	the SX1278 PHY
+ *
+ * Return:	true / false for restored / nothing to restore
+ */
+static bool
+sx1278_ieee_restore(struct sx1278_phy *phy)
+{
+	if (!phy->pm_asleep || !phy->pm_valid)
+		return false;
+
+	if (sx127X_restore_config(phy->map, phy->pm_regs)) {
+		phy->pm_valid = false;
+		return false;
 	}
-	spin_unlock_irqrestore(&phy->buf_lock, f);
+	phy->pm_asleep = false;
 
-	return ret;
+	return true;
 }
 
 static int
 sx1278_ieee_start(struct ieee802154_hw *hw)
 {
 	struct sx1278_phy *phy = hw->priv;
+	struct sx1278_chan *chan;
 
 	dev_dbg(regmap_get_device(phy->map), "interface up\n");
 
-	sx1278_ieee_set_channel(hw, 0, hw->phy->current_channel);
-	phy->suspended = false;
-	sx127X_start_loramode(phy->map);
-	phy->opmode = sx127X_get_mode(phy->map);
-	add_timer(&phy->timer);
+	pm_runtime_get_sync(hw->parent);
+
+	/* Restore the saved radio state in bursts, or configure it all. */
+	if (sx1278_ieee_restore(phy)) {
+		if (phy->pm_page != hw->phy->current_page ||
+		    phy->pm_channel != hw->phy->current_channel)
+			sx1278_ieee_set_channel(hw, hw->phy->current_page,
+						hw->phy->current_channel);
+	} else {
+		sx1278_ieee_init_radio(hw);
+	}
+
+	if (phy->cfg.auto_channel) {
+		chan = sx1278_ieee_scan(hw);
+		if (chan != phy->chan) {
+			dev_info(regmap_get_device(phy->map),
+				 "pick the least busy channel %u/%u\n",
+				 chan->page, chan->channel);
+			sx1278_ieee_tune(phy, chan);
+			hw->phy->current_page = chan->page;
+			hw->phy->current_channel = chan->channel;
+		}
+	}
+	phy->pm_page = hw->phy->current_page;
+	phy->pm_channel = hw->phy->current_channel;
+
+	sx1278_tdma_reset(phy);
+	phy->running = true;
+	sx1278_ieee_resume_rx(phy);
 
 	return 0;
 }
@@ -1368,53 +4883,150 @@ sx1278_ieee_stop(struct ieee802154_hw *hw)
 
 	dev_dbg(regmap_get_device(phy->map), "interface down\n");
 
-	phy->suspended = true;
-	del_timer(&phy->timer);
-	sx127X_set_state(phy->map, SX127X_SLEEP_MODE);
+	phy->running = false;
+	sx1278_ieee_save(phy);
+	phy->pm_page = hw->phy->current_page;
+	phy->pm_channel = hw->phy->current_channel;
+
+	pm_runtime_put(hw->parent);
 }
 
 static int
 sx1278_ieee_set_promiscuous_mode(struct ieee802154_hw *hw, const bool on)
 {
+	struct sx1278_phy *phy = hw->priv;
+
+	dev_dbg(regmap_get_device(phy->map),
+		"%s: %s\n", __func__, (on) ? "on" : "off");
+
+	phy->promiscuous = on;
+
 	return 0;
 }
 
+/**
+ * sx1278_ieee_poll - Read the status of the LoRa device for the state machine
+ * @phy:	the SX1278 PHY
+ */
+static void
+sx1278_ieee_poll(struct sx1278_phy *phy)
+{
+	phy->poll_flags = sx1278_xfer_read_reg(phy->xfer, SX127X_REG_IRQ_FLAGS);
+	phy->poll_time = ktime_get();
+	phy->poll_state = sx1278_xfer_read_reg(phy->xfer, SX127X_REG_OP_MODE);
+}
+
 void
 sx1278_ieee_statemachine(struct ieee802154_hw *hw)
 {
 	struct sx1278_phy *phy = hw->priv;
-	u8 flags;
-	u8 state;
+	struct sk_buff *skb;
+	int flags;
+	int state;
 	bool do_next_rx = false;
-	unsigned long f;
+	bool tx_done = false;
+	ktime_t now;
+	u32 toa;
+
+	flags = phy->poll_flags;
+	now = phy->poll_time;
+	state = phy->poll_state;
+	if (flags < 0 || state < 0)
+		return;
+	state &= 0x07;
 
-	flags = sx127X_get_loraallflag(phy->map);
-	state = sx127X_get_state(phy->map);
+	/* RX done happened between the last and this polling. */
+	if (flags & SX127X_FLAG_RXDONE)
+		phy->rx_done = ktime_add_ns(phy->last_poll,
+					    ktime_to_ns(ktime_sub(now,
+							phy->last_poll)) >> 1);
+	phy->last_poll = now;
 
 	if (flags & (SX127X_FLAG_RXTIMEOUT | SX127X_FLAG_PAYLOADCRCERROR)) {
-		sx127X_clear_loraflag(phy->map, SX127X_FLAG_RXTIMEOUT
-						| SX127X_FLAG_PAYLOADCRCERROR
-						| SX127X_FLAG_RXDONE);
-		spin_lock_irqsave(&phy->buf_lock, f);
-		phy->is_busy = false;
-		spin_unlock_irqrestore(&phy->buf_lock, f);
+		/* Monitor mode captures the frames with CRC error, too. */
+		if ((flags & SX127X_FLAG_PAYLOADCRCERROR) &&
+		    (flags & SX127X_FLAG_RXDONE) &&
+		    sx1278_cap_active(phy))
+			sx1278_ieee_rx_capture_bad(phy->hw);
+		sx1278_ieee_rx_ct_reset(phy);
+		sx1278_xfer_write_reg(phy->xfer, SX127X_REG_IRQ_FLAGS, flags
+				      | SX127X_FLAG_RXTIMEOUT
+				      | SX127X_FLAG_PAYLOADCRCERROR
+				      | SX127X_FLAG_RXDONE);
+		sx1278_ieee_hand_over(phy, SX1278_ST_RX_ARMED, SX1278_ST_IDLE);
 		do_next_rx = true;
 	} else if (flags & SX127X_FLAG_RXDONE) {
+		/* The ACK completes the frame waiting for it. */
+		tx_done = phy->ack_wait;
 		sx1278_ieee_rx_complete(phy->hw);
-		sx127X_clear_loraflag(phy->map, SX127X_FLAG_RXDONE);
+		tx_done = tx_done && !phy->ack_wait;
+		sx1278_xfer_write_reg(phy->xfer, SX127X_REG_IRQ_FLAGS,
+				      flags | SX127X_FLAG_RXDONE);
 		do_next_rx = true;
+	} else if ((flags & SX127X_FLAG_VALIDHEADER) &&
+		   state == SX127X_RXSINGLE_MODE) {
+		/* Read the payload while it is still on air. */
+		sx1278_ieee_rx_stream(phy);
 	}
 
-	if (flags & SX127X_FLAG_TXDONE) {
-		sx1278_ieee_tx_complete(phy->hw);
-		sx127X_clear_loraflag(phy->map, SX127X_FLAG_TXDONE);
-		phy->tx_delay = 10;
+	if ((flags & SX127X_FLAG_TXDONE) && phy->tdma.beacon_tx) {
+		phy->tdma.beacon_tx = false;
+		sx1278_ieee_hand_over(phy, SX1278_ST_TX_ACTIVE, SX1278_ST_IDLE);
+		sx1278_xfer_write_reg(phy->xfer, SX127X_REG_IRQ_FLAGS,
+				      flags | SX127X_FLAG_TXDONE);
+		do_next_rx = true;
+	} else if ((flags & SX127X_FLAG_TXDONE) && phy->ack_tx) {
+		phy->ack_tx = false;
+		sx1278_ieee_hand_over(phy, SX1278_ST_TX_ACTIVE, SX1278_ST_IDLE);
+		sx1278_xfer_write_reg(phy->xfer, SX127X_REG_IRQ_FLAGS,
+				      flags | SX127X_FLAG_TXDONE);
 		do_next_rx = true;
+	} else if (flags & SX127X_FLAG_TXDONE) {
+		sx1278_xfer_write_reg(phy->xfer, SX127X_REG_IRQ_FLAGS,
+				      flags | SX127X_FLAG_TXDONE);
+		skb = READ_ONCE(phy->tx_buf);
+		toa = sx127X_lora_toa(&phy->mod, (phy->implicit_len) ?
+						 phy->implicit_len : skb->len);
+		phy->burst_us += toa;
+		if (sx1278_ieee_ack_req(skb->data, skb->len)) {
+			sx1278_ieee_wait_ack(phy, now);
+		} else {
+			sx1278_ieee_tx_complete(phy->hw);
+			phy->tx_delay = 10;
+			tx_done = true;
+		}
+		do_next_rx = true;
+	}
+
+	/* The stack's next frame goes on air within the burst, if any. */
+	if (tx_done && sx1278_ieee_burst(phy)) {
+		state = SX127X_TX_MODE;
+		do_next_rx = false;
 	}
 
-	if (phy->one_to_be_sent &&
-	    (state == SX127X_STANDBY_MODE) &&
-	    (phy->tx_delay == 0)) {
+	/* The reconfiguration takes the place of the RX at an idle point. */
+	if (sx1278_ieee_idle_req(phy, &state))
+		do_next_rx = true;
+
+	/*
+	 * The frame waiting for its ACK holds the TX path, and TDMA holds the
+	 * queued frame until the own slot.
+	 */
+	if (phy->ack_wait && !sx1278_ieee_check_ack(phy, now, &state))
+		/* Listen through the backoff, or after giving up the frame. */
+		do_next_rx = true;
+
+	if (phy->ack_wait) {
+		/* Keep listening until the ACK or the time-out. */
+	} else if (phy->tdma.role != SX1278_TDMA_OFF &&
+	    !sx1278_tdma_schedule(phy, now, &state)) {
+		if (phy->tdma.beacon_tx)
+			do_next_rx = false;
+	} else if (READ_ONCE(phy->tx_buf) &&
+	    (phy->tx_delay == 0) &&
+	    sx1278_dc_admit(phy, phy->tx_buf->len) &&
+	    (state == SX127X_STANDBY_MODE ||
+	     sx1278_ieee_preempt_rx(phy, &state))) {
 		if (!sx1278_ieee_tx(phy->hw))
 			do_next_rx = false;
 	}
@@ -1424,37 +5036,198 @@ sx1278_ieee_statemachine(struct ieee802154_hw *hw)
 
 	if (phy->tx_delay > 0)
 		phy->tx_delay -= 1;
+}
 
-	if (!phy->suspended) {
-		phy->timer.expires = jiffies_64 + 1;
-		add_timer(&phy->timer);
-	}
+/*-------------------------- SX1278 SPI Bus Passes ---------------------------*/
+
+/* The window of the bus utilization in ms */
+#ifndef SX1278_BUS_WINDOW
+#define SX1278_BUS_WINDOW	1000
+#endif
+
+static LIST_HEAD(sx1278_buses);
+static DEFINE_MUTEX(sx1278_buses_lock);
+
+/**
+ * sx1278_bus_bulk - Check whether the polled status leads to FIFO reads
+ * @phy:	the SX1278 PHY
+ *
+ * Return:	true / false for bulk / urgent
+ */
+static bool
+sx1278_bus_bulk(struct sx1278_phy *phy)
+{
+	return phy->poll_flags >= 0 &&
+	       (phy->poll_flags & (SX127X_FLAG_RXDONE
+				   | SX127X_FLAG_VALIDHEADER));
 }
 
 /**
- * sx1278_timer_irqwork - The actual work which checks the IRQ flags of the chip
+ * sx1278_bus_work - Poll all the radios on the SPI bus in one pass
  * @work:	the work entry listed in the workqueue
+ *
+ * The status of every radio is read first.  TX done, RX time-out and the TX
+ * start are served before the radios with a frame in the FIFO, so a long FIFO
+ * read does not hold the mode switches of the others.
  */
 static void
-sx1278_timer_irqwork(struct work_struct *work)
+sx1278_bus_work(struct work_struct *work)
 {
+	struct sx1278_bus *bus = container_of(work, struct sx1278_bus, work);
 	struct sx1278_phy *phy;
+	bool active = false;
+	ktime_t start;
+	ktime_t end;
+	s64 ns;
+	int bulk;
+
+	mutex_lock(&bus->lock);
+	start = ktime_get();
+
+	list_for_each_entry(phy, &bus->phys, bus_node) {
+		if (phy->suspended) {
+			phy->poll_flags = -ENODATA;
+			continue;
+		}
+		sx1278_ieee_poll(phy);
+		active = true;
+	}
+
+	for (bulk = 0; bulk < 2; bulk++) {
+		list_for_each_entry(phy, &bus->phys, bus_node) {
+			if (!phy->suspended && sx1278_bus_bulk(phy) == bulk)
+				sx1278_ieee_statemachine(phy->hw);
+		}
+	}
+
+	end = ktime_get();
+	ns = ktime_to_ns(ktime_sub(end, start));
+	bus->passes++;
+	bus->busy_ns += ns;
+	bus->max_pass_ns = max(bus->max_pass_ns, ns);
+	if (ktime_ms_delta(end, bus->window) >= SX1278_BUS_WINDOW) {
+		bus->util = div64_s64(bus->busy_ns * 1000,
+				      ktime_to_ns(ktime_sub(end, bus->window)));
+		bus->window = end;
+		bus->busy_ns = 0;
+	}
+
+	if (active)
+		mod_timer(&bus->timer, jiffies + 1);
+	mutex_unlock(&bus->lock);
+}
+
+/**
+ * sx1278_bus_isr - Callback function for the timer interrupt of the bus
+ * @timer:	the timer of the bus
+ */
+static void
+sx1278_bus_isr(struct timer_list *timer)
+{
+	struct sx1278_bus *bus = container_of(timer, struct sx1278_bus, timer);
+
+	schedule_work(&bus->work);
+}
+
+/**
+ * sx1278_bus_attach - Join the passes of the radio's SPI controller
+ * @phy:	the SX1278 PHY
+ *
+ * The radio stays paused until sx1278_ieee_resume_rx.
+ *
+ * Return:	0 / negative values for success / failed
+ */
+static int
+sx1278_bus_attach(struct sx1278_phy *phy)
+{
+	struct spi_controller *ctlr = phy->xfer->spi->controller;
+	struct sx1278_bus *bus;
+
+	phy->suspended = true;
+
+	mutex_lock(&sx1278_buses_lock);
+	list_for_each_entry(bus, &sx1278_buses, node) {
+		if (bus->ctlr == ctlr)
+			goto sx1278_bus_attach_found;
+	}
 
-	phy = container_of(work, struct sx1278_phy, irqwork);
-	sx1278_ieee_statemachine(phy->hw);
+	bus = kzalloc(sizeof(*bus), GFP_KERNEL);
+	if (!bus) {
+		mutex_unlock(&sx1278_buses_lock);
+		return -ENOMEM;
+	}
+	bus->ctlr = ctlr;
+	INIT_LIST_HEAD(&bus->phys);
+	mutex_init(&bus->lock);
+	INIT_WORK(&bus->work, sx1278_bus_work);
+	timer_setup(&bus->timer, sx1278_bus_isr, 0);
+	bus->window = ktime_get();
+	list_add(&bus->node, &sx1278_buses);
+
+sx1278_bus_attach_found:
+	mutex_lock(&bus->lock);
+	list_add_tail(&phy->bus_node, &bus->phys);
+	mutex_unlock(&bus->lock);
+	phy->bus = bus;
+	mutex_unlock(&sx1278_buses_lock);
+
+	return 0;
 }
 
 /**
- * sx1278_timer_isr - Callback function for the timer interrupt
- * @arg:	the general argument for this callback function
+ * sx1278_bus_detach - Leave the passes of the radio's SPI controller
+ * @phy:	the SX1278 PHY
+ *
+ * The last radio on the controller frees the bus.
  */
 static void
-sx1278_timer_isr(struct timer_list *timer)
+sx1278_bus_detach(struct sx1278_phy *phy)
+{
+	struct sx1278_bus *bus = phy->bus;
+
+	if (!bus)
+		return;
+
+	mutex_lock(&sx1278_buses_lock);
+	mutex_lock(&bus->lock);
+	list_del(&phy->bus_node);
+	mutex_unlock(&bus->lock);
+	phy->bus = NULL;
+
+	if (list_empty(&bus->phys)) {
+		list_del(&bus->node);
+		timer_delete_sync(&bus->timer);
+		cancel_work_sync(&bus->work);
+		/* The work may have armed the timer again before it was done. */
+		timer_delete_sync(&bus->timer);
+		kfree(bus);
+	}
+	mutex_unlock(&sx1278_buses_lock);
+}
+
+static int
+sx1278_bus_show(struct seq_file *s, void *data)
 {
-	struct sx1278_phy *phy = container_of(timer, struct sx1278_phy, timer);
+	struct sx1278_phy *phy = s->private;
+	struct sx1278_bus *bus = phy->bus;
+	struct sx1278_phy *p;
+
+	mutex_lock(&bus->lock);
+	seq_printf(s, "controller: %s\n", dev_name(&bus->ctlr->dev));
+	seq_printf(s, "utilization: %u.%u%%\n", bus->util / 10, bus->util % 10);
+	seq_printf(s, "passes: %llu\n", bus->passes);
+	seq_printf(s, "max pass: %lld us\n",
+		   div_s64(bus->max_pass_ns, NSEC_PER_USEC));
+	seq_puts(s, "radios:");
+	list_for_each_entry(p, &bus->phys, bus_node)
+		seq_printf(s, " %s%s", dev_name(p->hw->parent),
+			   (p->suspended) ? "(paused)" : "");
+	seq_putc(s, '\n');
+	mutex_unlock(&bus->lock);
 
-	schedule_work(&phy->irqwork);
+	return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(sx1278_bus);
 
 static const struct ieee802154_ops sx1278_ops = {
 	.owner = THIS_MODULE,
@@ -1465,25 +5238,81 @@ static const struct ieee802154_ops sx1278_ops = {
 	.start = sx1278_ieee_start,
 	.stop = sx1278_ieee_stop,
 	.set_promiscuous_mode = sx1278_ieee_set_promiscuous_mode,
+	.set_hw_addr_filt = sx1278_ieee_set_hw_addr_filt,
+	.set_frame_retries = sx1278_ieee_set_frame_retries,
 };
 
+/* The debugfs root folder of all the SX1278 devices. */
+static struct dentry *sx1278_debugfs_root;
+
 /**
- * sx1278X_ieee_channel_mask - Get the available channels' mask of LoRa device
- * @hw:		LoRa IEEE 802.15.4 device
+ * sx1278_ieee_get_config - Parse the settings of the LoRa device
+ * @phy:	the SX1278 PHY
  *
- * Return:	The bitwise channel mask in 4 bytes
+ * DT properties override the module parameters.  They are parsed once at
+ * probing, so each device keeps its own settings.
  */
-u32
-sx1278_ieee_channel_mask(struct ieee802154_hw *hw)
+static void
+sx1278_ieee_get_config(struct sx1278_phy *phy)
 {
-	struct rf_frq rf;
-	u32 mask;
-
-	sx1278_ieee_get_rf_config(hw, &rf);
+	struct device_node *of_node = regmap_get_device(phy->map)->of_node;
+	struct sx1278_config *cfg = &phy->cfg;
+	const char *role;
+
+	cfg->xosc = xosc_frq;
+	cfg->sprf = sprf;
+	cfg->rx_timeout = rx_timeout;
+	cfg->carrier = carrier_frq;
+	cfg->bw = bandwidth;
+	cfg->ch_min = channel_min;
+	cfg->ch_max = channel_max;
+	cfg->afc = afc;
+	cfg->auto_channel = auto_channel;
+	cfg->tdma_role = tdma_role;
+	cfg->tdma_slots = tdma_slots;
+	cfg->tdma_slot = tdma_slot;
+	cfg->duty_window = duty_window;
+
+	of_property_read_u32(of_node, "clock-frequency", &cfg->xosc);
+	of_property_read_u32(of_node, "spreading-factor", &cfg->sprf);
+	of_property_read_u32(of_node, "center-carrier-frq", &cfg->carrier);
+	of_property_read_u32(of_node, "rf-bandwidth", &cfg->bw);
+	of_property_read_u8(of_node, "minimal-RF-channel", &cfg->ch_min);
+	of_property_read_u8(of_node, "maximum-RF-channel", &cfg->ch_max);
+	cfg->pa_boost = of_property_read_bool(of_node, "pa-boost");
+	cfg->afc |= of_property_read_bool(of_node, "afc");
+	cfg->auto_channel |= of_property_read_bool(of_node, "auto-channel");
+	if (!of_property_read_string(of_node, "tdma-role", &role))
+		cfg->tdma_role = (!strcmp(role, "gateway")) ?
+				 SX1278_TDMA_GATEWAY : SX1278_TDMA_NODE;
+	of_property_read_u8(of_node, "tdma-slots", &cfg->tdma_slots);
+	of_property_read_u8(of_node, "tdma-slot", &cfg->tdma_slot);
+	of_property_read_u32(of_node, "duty-cycle-window", &cfg->duty_window);
+	if (cfg->tdma_role > SX1278_TDMA_NODE || !cfg->tdma_slots ||
+	    !cfg->tdma_slot)
+		cfg->tdma_role = SX1278_TDMA_OFF;
+
+	if (cfg->sprf > phy->variant->sprf_max)
+		cfg->sprf = phy->variant->sprf_max;
+}
 
-	mask = ((u32)(1 << (rf.ch_max + 1)) - (u32)(1 << rf.ch_min));
+/**
+ * sx1278_ieee_reset - Reset the LoRa device through the optional reset pin
+ * @phy:	the SX1278 PHY
+ *
+ * A chip wedged by a warm reboot gets back to its reset state.  The reset pin
+ * is pulled for at least 100us and the chip is ready 5ms later.
+ */
+static void
+sx1278_ieee_reset(struct sx1278_phy *phy)
+{
+	if (!phy->reset)
+		return;
 
-	return mask;
+	gpiod_set_value_cansleep(phy->reset, 1);
+	usleep_range(100, 200);
+	gpiod_set_value_cansleep(phy->reset, 0);
+	usleep_range(5000, 6000);
 }
 
 static int
@@ -1492,41 +5321,99 @@ sx1278_ieee_add_one(struct sx1278_phy *phy)
 	struct ieee802154_hw *hw = phy->hw;
 	int err;
 
-	/* Define channels could be used. */
-	hw->phy->supported.channels[0] = sx1278_ieee_channel_mask(hw);
-	/* SX1278 phy channel 11 as default */
-	hw->phy->current_channel = 11;
+	err = sx1278_bus_attach(phy);
+	if (err)
+		return err;
+
+	atomic_set(&phy->state, SX1278_ST_IDLE);
+	spin_lock_init(&phy->cap_lock);
+	spin_lock_init(&phy->req_lock);
+	init_waitqueue_head(&phy->cap_wq);
+	init_waitqueue_head(&phy->req_wq);
+
+	/* Detect the chip before it is exposed as an IEEE 802.15.4 device. */
+	sx1278_ieee_reset(phy);
+	err = init_sx127x(phy->map);
+	if (err)
+		goto sx1278_ieee_add_one_err;
 
-	/* Define RF power. */
-	hw->phy->supported.tx_powers = sx1278_powers;
-	hw->phy->supported.tx_powers_size = ARRAY_SIZE(sx1278_powers);
-	hw->phy->transmit_power = sx1278_powers[12];
+	/* Define channels could be used. */
+	sx1278_ieee_get_config(phy);
+	phy->tdma.role = phy->cfg.tdma_role;
+	phy->frame_retries = SX1278_FRAME_RETRIES;
+	phy->pan_id = SX1278_ADDR_BCAST;
+	phy->short_addr = SX1278_ADDR_BCAST;
+	sx1278_dc_reset(phy);
+	phy->tdma.n_slots = phy->cfg.tdma_slots;
+	phy->tdma.slot = phy->cfg.tdma_slot;
+	err = sx1278_ieee_build_chans(phy);
+	if (err)
+		goto sx1278_ieee_add_one_err;
+	/* SX1278 phy channel 11 as default, or the first available one */
+	phy->chan = sx1278_ieee_find_chan(phy, 0, 11);
+	if (!phy->chan)
+		phy->chan = &phy->chans[0];
+	hw->phy->current_page = phy->chan->page;
+	hw->phy->current_channel = phy->chan->channel;
+
+	/* Define RF power according to the power amplifier wiring. */
+	if (phy->cfg.pa_boost) {
+		hw->phy->supported.tx_powers = sx1278_paboost_powers;
+		hw->phy->supported.tx_powers_size =
+					ARRAY_SIZE(sx1278_paboost_powers);
+	} else {
+		hw->phy->supported.tx_powers = sx1278_rfo_powers;
+		hw->phy->supported.tx_powers_size =
+					ARRAY_SIZE(sx1278_rfo_powers);
+	}
+	hw->phy->transmit_power = sx127X_dbm2mbm(10);
 
 	ieee802154_random_extended_addr(&hw->phy->perm_extended_addr);
 	hw->flags = IEEE802154_HW_TX_OMIT_CKSUM
 			| IEEE802154_HW_RX_OMIT_CKSUM
-			| IEEE802154_HW_PROMISCUOUS;
+			| IEEE802154_HW_PROMISCUOUS
+			| IEEE802154_HW_AFILT
+			| IEEE802154_HW_AACK
+			| IEEE802154_HW_FRAME_RETRIES;
+
+	/*
+	 * Configure the radio during probing and keep it asleep with the
+	 * snapshot, so bringing the interface up is only a restore.
+	 */
+	sx1278_ieee_init_radio(hw);
+	sx1278_ieee_save(phy);
+	phy->pm_page = hw->phy->current_page;
+	phy->pm_channel = hw->phy->current_channel;
+
+	phy->debugfs = debugfs_create_dir(dev_name(hw->parent),
+					  sx1278_debugfs_root);
+	debugfs_create_file("capture", 0400, phy->debugfs, phy,
+			    &sx1278_cap_fops);
+	debugfs_create_file("afc", 0400, phy->debugfs, phy, &sx1278_afc_fops);
+	debugfs_create_file("scan", 0600, phy->debugfs, phy, &sx1278_scan_fops);
+	debugfs_create_file("tdma", 0600, phy->debugfs, phy, &sx1278_tdma_fops);
+	debugfs_create_file("filter", 0400, phy->debugfs, phy,
+			    &sx1278_filter_fops);
+	debugfs_create_file("dutycycle", 0400, phy->debugfs, phy,
+			    &sx1278_dc_fops);
+	debugfs_create_file("spi_record", 0400, phy->debugfs, phy->rr,
+			    &sx1278_rr_record_fops);
+	debugfs_create_file("spi_replay", 0600, phy->debugfs, phy->rr,
+			    &sx1278_rr_replay_fops);
+	debugfs_create_file("bus", 0400, phy->debugfs, phy, &sx1278_bus_fops);
 
 	err = ieee802154_register_hw(hw);
-	if (err)
-		goto err_reg;
-
-	INIT_WORK(&phy->irqwork, sx1278_timer_irqwork);
-
-	timer_setup(&phy->timer, sx1278_timer_isr, 0);
-	phy->timer.expires = jiffies_64 + HZ;
-
-	spin_lock_init(&phy->buf_lock);
-
-	err = init_sx127x(phy->map);
-	if (err)
-		goto err_reg;
+	if (err) {
+		dev_err(regmap_get_device(phy->map),
+			"register as IEEE 802.15.4 device failed\n");
+		debugfs_remove_recursive(phy->debugfs);
+		goto sx1278_ieee_add_one_err;
+	}
 
 	return 0;
 
-err_reg:
-	dev_err(regmap_get_device(phy->map),
-		"register as IEEE 802.15.4 device failed\n");
+sx1278_ieee_add_one_err:
+	sx1278_bus_detach(phy);
 	return err;
 }
 
@@ -1536,10 +5423,12 @@ sx1278_ieee_del(struct sx1278_phy *phy)
 	if (!phy)
 		return;
 
-	del_timer(&phy->timer);
-	flush_work(&phy->irqwork);
-
 	ieee802154_unregister_hw(phy->hw);
+
+	debugfs_remove_recursive(phy->debugfs);
+	sx1278_bus_detach(phy);
+	sx1278_rr_free(phy->rr);
+
 	ieee802154_free_hw(phy->hw);
 }
 
@@ -1548,11 +5437,11 @@ sx1278_ieee_del(struct sx1278_phy *phy)
 /* The compatible chip array. */
 #ifdef CONFIG_OF
 static const struct of_device_id sx1278_dt_ids[] = {
-	{ .compatible = "semtech,sx1276" },
-	{ .compatible = "semtech,sx1277" },
-	{ .compatible = "semtech,sx1278" },
-	{ .compatible = "semtech,sx1279" },
-	{ .compatible = "sx1278" },
+	{ .compatible = "semtech,sx1276", .data = &sx1276_variant },
+	{ .compatible = "semtech,sx1277", .data = &sx1277_variant },
+	{ .compatible = "semtech,sx1278", .data = &sx1278_variant },
+	{ .compatible = "semtech,sx1279", .data = &sx1279_variant },
+	{ .compatible = "sx1278", .data = &sx1278_variant },
 	{},
 };
 MODULE_DEVICE_TABLE(of, sx1278_dt_ids);
@@ -1605,7 +5494,38 @@ static int sx1278_spi_probe(struct spi_device *spi)
 	phy = hw->priv;
 	phy->hw = hw;
 	hw->parent = &spi->dev;
-	phy->map = devm_regmap_init_spi(spi, &sx1278_regmap_config);
+	/* The DMA-safe SPI transport of the hot paths and regmap. */
+	phy->rr = devm_kzalloc(&spi->dev, sizeof(*phy->rr), GFP_KERNEL);
+	phy->xfer = devm_kzalloc(&spi->dev, sizeof(*phy->xfer), GFP_KERNEL);
+	if (!phy->rr || !phy->xfer) {
+		err = -ENOMEM;
+		goto sx1278_spi_probe_err;
+	}
+	spin_lock_init(&phy->rr->lock);
+	init_waitqueue_head(&phy->rr->wq);
+	mutex_init(&phy->rr->replay_lock);
+	sx1278_xfer_init(phy->xfer, spi);
+	phy->xfer->rr = phy->rr;
+
+	phy->map = devm_regmap_init(&spi->dev, &sx1278_xfer_regmap_bus,
+				    phy->xfer, &sx1278_regmap_config);
+	if (IS_ERR(phy->map)) {
+		err = PTR_ERR(phy->map);
+		goto sx1278_spi_probe_err;
+	}
+
+	/* The optional reset pin, NRESET is active low on the chip. */
+	phy->reset = devm_gpiod_get_optional(&spi->dev, "reset",
+					     GPIOD_OUT_LOW);
+	if (IS_ERR(phy->reset)) {
+		err = PTR_ERR(phy->reset);
+		goto sx1278_spi_probe_err;
+	}
+
+	/* The chip variant. */
+	phy->variant = of_device_get_match_data(&spi->dev);
+	if (!phy->variant)
+		phy->variant = &sx1278_variant;
 
 	/* Set the SPI device's driver data for later usage. */
 	spi_set_drvdata(spi, phy);
@@ -1616,26 +5536,76 @@ static int sx1278_spi_probe(struct spi_device *spi)
 		goto sx1278_spi_probe_err;
 	}
 
+	pm_runtime_set_active(&spi->dev);
+	pm_runtime_enable(&spi->dev);
+
 	dev_info(&spi->dev,
 		 "add an IEEE 802.15.4 over LoRa SX1278 compatible device\n");
 
 	return 0;
 
 sx1278_spi_probe_err:
-	sx1278_ieee_del(phy);
+	ieee802154_free_hw(hw);
 	return err;
 }
 
 /* The SPI remove callback function. */
-static int sx1278_spi_remove(struct spi_device *spi)
+static void sx1278_spi_remove(struct spi_device *spi)
 {
 	struct sx1278_phy *phy = spi_get_drvdata(spi);
 
+	pm_runtime_disable(&spi->dev);
 	sx1278_ieee_del(phy);
+}
+
+/* The system suspend callback function. */
+static int __maybe_unused sx1278_spi_suspend(struct device *dev)
+{
+	struct sx1278_phy *phy = spi_get_drvdata(to_spi_device(dev));
+
+	if (phy->running)
+		sx1278_ieee_save(phy);
+
+	return 0;
+}
+
+/* The system resume callback function. */
+static int __maybe_unused sx1278_spi_resume(struct device *dev)
+{
+	struct sx1278_phy *phy = spi_get_drvdata(to_spi_device(dev));
+
+	if (!phy->running)
+		return 0;
+
+	if (!sx1278_ieee_restore(phy))
+		sx1278_ieee_init_radio(phy->hw);
+	sx1278_ieee_resume_rx(phy);
+
+	return 0;
+}
+
+/* The runtime suspend callback function while the interface is down. */
+static int __maybe_unused sx1278_spi_runtime_suspend(struct device *dev)
+{
+	struct sx1278_phy *phy = spi_get_drvdata(to_spi_device(dev));
+
+	sx1278_ieee_save(phy);
+
+	return 0;
+}
 
+/* The runtime resume callback function.  The radio is restored at start. */
+static int __maybe_unused sx1278_spi_runtime_resume(struct device *dev)
+{
 	return 0;
 }
 
+static const struct dev_pm_ops sx1278_pm_ops = {
+	SET_SYSTEM_SLEEP_PM_OPS(sx1278_spi_suspend, sx1278_spi_resume)
+	SET_RUNTIME_PM_OPS(sx1278_spi_runtime_suspend,
+			   sx1278_spi_runtime_resume, NULL)
+};
+
 #define __DRIVER_NAME	"sx1278"
 
 /* The SPI driver which acts as a protocol driver in this kernel module. */
@@ -1649,6 +5619,9 @@ static struct spi_driver sx1278_spi_driver = {
 #ifdef CONFIG_ACPI
 		.acpi_match_table = ACPI_PTR(sx1278_acpi_ids),
 #endif
+		.pm = &sx1278_pm_ops,
+		/* Radios on the board are detected and configured in parallel. */
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
 	},
 	.probe = sx1278_spi_probe,
 	.remove = sx1278_spi_remove,
@@ -1656,8 +5629,33 @@ static struct spi_driver sx1278_spi_driver = {
 };
 
 /* Register SX1278 kernel module. */
-module_spi_driver(sx1278_spi_driver);
+static int __init
+sx1278_init(void)
+{
+	int err;
+
+	sx1278_debugfs_root = debugfs_create_dir(__DRIVER_NAME, NULL);
+
+	err = spi_register_driver(&sx1278_spi_driver);
+	if (err)
+		debugfs_remove_recursive(sx1278_debugfs_root);
+
+	return err;
+}
+module_init(sx1278_init);
+
+static void __exit
+sx1278_exit(void)
+{
+	spi_unregister_driver(&sx1278_spi_driver);
+	debugfs_remove_recursive(sx1278_debugfs_root);
+}
+module_exit(sx1278_exit);
 
 MODULE_AUTHOR("Jian-Hong Pan, <starnight@g.ncu.edu.tw>");
 MODULE_DESCRIPTION("LoRa device SX1278 driver with IEEE 802.15.4 interface");
 MODULE_LICENSE("Dual BSD/GPL");
+
+#if IS_ENABLED(CONFIG_SX1278_KUNIT_TEST)
+#include "sx1278_test.c"
+#endif
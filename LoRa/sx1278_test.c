@@ -0,0 +1,682 @@
+/*
+ * KUnit suite of the SX1278 driver, under the same license as sx1278.c.
+ *
+ * The suite is included at the end of sx1278.c, so it reaches the static
+ * functions.  The LoRa helpers run on a mock regmap over a register file, and
+ * the state machine runs on the SPI replay fed with synthetic transactions in
+ * place of the chip.
+ */
+
+#include <kunit/test.h>
+#include <kunit/device.h>
+
+/* The register file behind the mock regmap */
+struct sx1278_test {
+	u8 regs[SX127X_MAX_REG + 1];
+	struct regmap *map;
+	/* The stack's frame passed on the next completion */
+	struct sk_buff *tx_next;
+	int tx_done;
+};
+
+static int
+sx1278_test_regmap_write(void *context, const void *data, size_t count)
+{
+	struct sx1278_test *t = context;
+	const u8 *buf = data;
+	u8 reg = buf[0] & ~SX127X_SPI_WRITE;
+
+	if (count < 1 || reg + count - 1 > sizeof(t->regs))
+		return -EINVAL;
+	memcpy(t->regs + reg, buf + 1, count - 1);
+
+	return 0;
+}
+
+static int
+sx1278_test_regmap_read(void *context, const void *reg, size_t reg_size,
+			void *val, size_t val_size)
+{
+	struct sx1278_test *t = context;
+	u8 r = *(const u8 *)reg;
+
+	if (r + val_size > sizeof(t->regs))
+		return -EINVAL;
+	memcpy(val, t->regs + r, val_size);
+
+	return 0;
+}
+
+static const struct regmap_bus sx1278_test_regmap_bus = {
+	.write = sx1278_test_regmap_write,
+	.read = sx1278_test_regmap_read,
+};
+
+static int
+sx1278_test_init(struct kunit *test)
+{
+	struct sx1278_test *t;
+	struct device *dev;
+
+	t = kunit_kzalloc(test, sizeof(*t), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, t);
+
+	dev = kunit_device_register(test, "sx1278-test");
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, dev);
+	t->map = devm_regmap_init(dev, &sx1278_test_regmap_bus, t,
+				  &sx1278_regmap_config);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, t->map);
+	test->priv = t;
+
+	return 0;
+}
+
+/* A stride off the FRF steps, so the sweep hits all the rounding cases */
+#define SX1278_TEST_FRQ_STRIDE	100007
+
+/**
+ * sx1278_test_frq - Set the RF frequency and read it back
+ * @test:	the test
+ * @frq:	the RF frequency in Hz
+ */
+static void
+sx1278_test_frq(struct kunit *test, u32 frq)
+{
+	struct sx1278_test *t = test->priv;
+	s64 step = DIV_ROUND_UP(F_XOSC, __POW_2_19);
+	u8 *regs = t->regs;
+
+	sx127X_set_lorafrq(t->map, frq, F_XOSC);
+	KUNIT_EXPECT_EQ(test, (u32)regs[SX127X_REG_FRF_MSB] << 16 |
+			      (u32)regs[SX127X_REG_FRF_MSB + 1] << 8 |
+			      regs[SX127X_REG_FRF_MSB + 2],
+			sx127X_lorafrq2frf(frq, F_XOSC));
+	/* Both ways round to the nearest FRF step. */
+	KUNIT_EXPECT_LE(test,
+			abs((s64)sx127X_get_lorafrq(t->map, F_XOSC) - frq),
+			step / 2);
+	/* LowFrequencyModeOn follows the band, and stays in between. */
+	if (frq <= 525000000 || frq >= 779000000)
+		KUNIT_EXPECT_EQ(test, !!(regs[SX127X_REG_OP_MODE] & 0x08),
+				frq <= 525000000);
+}
+
+static void
+sx1278_test_lorafrq(struct kunit *test)
+{
+	static const struct sx1278_variant * const variants[] = {
+		&sx1276_variant, &sx1277_variant,
+		&sx1278_variant, &sx1279_variant,
+	};
+	struct sx1278_test *t = test->priv;
+	const struct sx1278_chplan_page *pg;
+	const struct sx1278_chplan *plan;
+	const struct sx1278_variant *v;
+	u32 frq;
+	int i, j, k;
+
+	for (i = 0; i < ARRAY_SIZE(variants); i++) {
+		v = variants[i];
+		for (frq = v->frq_min; frq < v->frq_max;
+		     frq += SX1278_TEST_FRQ_STRIDE)
+			sx1278_test_frq(test, frq);
+		sx1278_test_frq(test, v->frq_max);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(sx1278_chplans); i++) {
+		plan = &sx1278_chplans[i];
+		for (j = 0; j < plan->n_pages; j++) {
+			pg = &plan->pages[j];
+			for (k = 0; k < pg->count; k++)
+				sx1278_test_frq(test,
+						pg->frq + k * pg->spacing);
+		}
+	}
+
+	/* 434 MHz is a whole FRF step with the 32 MHz crystal. */
+	sx127X_set_lorafrq(t->map, 434000000, F_XOSC);
+	KUNIT_EXPECT_EQ(test, t->regs[SX127X_REG_FRF_MSB], 0x6C);
+	KUNIT_EXPECT_EQ(test, t->regs[SX127X_REG_FRF_MSB + 1], 0x80);
+	KUNIT_EXPECT_EQ(test, t->regs[SX127X_REG_FRF_MSB + 2], 0x00);
+	KUNIT_EXPECT_EQ(test, sx127X_get_lorafrq(t->map, F_XOSC), 434000000);
+}
+
+/* Every FRF step of the widest variant, SX1276, converts back to itself. */
+static void
+sx1278_test_lorafrf(struct kunit *test)
+{
+	u32 frf_min = sx127X_lorafrq2frf(sx1276_variant.frq_min, F_XOSC);
+	u32 frf_max = sx127X_lorafrq2frf(sx1276_variant.frq_max, F_XOSC);
+	u32 mismatched = 0;
+	u32 frf;
+	u32 frq;
+
+	for (frf = frf_min; frf <= frf_max; frf++) {
+		/* The step's frequency to the nearest Hz, as read back */
+		frq = ((u64)frf * F_XOSC + __POW_2_19 / 2) >> 19;
+		if (sx127X_lorafrq2frf(frq, F_XOSC) != frf)
+			mismatched++;
+	}
+	KUNIT_EXPECT_EQ(test, mismatched, 0);
+}
+
+static void
+sx1278_test_lorapower(struct kunit *test)
+{
+	struct sx1278_test *t = test->priv;
+	s32 p;
+
+	/* RFO pin: -3 to +15 dbm */
+	sx127X_set_boost(t->map, 0);
+	for (p = -3; p <= 15; p++) {
+		sx127X_set_lorapower(t->map, p);
+		KUNIT_EXPECT_EQ(test, sx127X_get_lorapower(t->map), p);
+	}
+	sx127X_set_lorapower(t->map, -10);
+	KUNIT_EXPECT_EQ(test, sx127X_get_lorapower(t->map), -3);
+	sx127X_set_lorapower(t->map, 20);
+	KUNIT_EXPECT_EQ(test, sx127X_get_lorapower(t->map), 15);
+
+	/* PA_BOOST pin: +2 to +17 dbm, or +20 dbm with PA_DAC */
+	sx127X_set_boost(t->map, 1);
+	for (p = 2; p <= 17; p++) {
+		sx127X_set_lorapower(t->map, p);
+		KUNIT_EXPECT_EQ(test, sx127X_get_lorapower(t->map), p);
+		KUNIT_EXPECT_EQ(test, t->regs[SX127X_REG_PA_DAC], 0x84);
+	}
+	for (p = 18; p <= 19; p++) {
+		sx127X_set_lorapower(t->map, p);
+		KUNIT_EXPECT_EQ(test, sx127X_get_lorapower(t->map), 17);
+		KUNIT_EXPECT_EQ(test, t->regs[SX127X_REG_PA_DAC], 0x84);
+	}
+	sx127X_set_lorapower(t->map, 20);
+	KUNIT_EXPECT_EQ(test, sx127X_get_lorapower(t->map), 20);
+	KUNIT_EXPECT_EQ(test, t->regs[SX127X_REG_PA_DAC], 0x87);
+	/* The over current protection: 140 mA for PA_DAC, 100 mA otherwise */
+	KUNIT_EXPECT_EQ(test, t->regs[SX127X_REG_OCP], 0x20 | 17);
+	sx127X_set_lorapower(t->map, 0);
+	KUNIT_EXPECT_EQ(test, sx127X_get_lorapower(t->map), 2);
+	KUNIT_EXPECT_EQ(test, t->regs[SX127X_REG_OCP], 0x20 | 11);
+}
+
+static void
+sx1278_test_loralna(struct kunit *test)
+{
+	struct sx1278_test *t = test->priv;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(lna_gain); i++) {
+		sx127X_set_loralna(t->map, lna_gain[i]);
+		KUNIT_EXPECT_EQ(test, t->regs[SX127X_REG_LNA] >> 5, i + 1);
+		KUNIT_EXPECT_EQ(test, sx127X_get_loralna(t->map), lna_gain[i]);
+	}
+
+	/* A gain between the steps takes the next lower one. */
+	sx127X_set_loralna(t->map, -10);
+	KUNIT_EXPECT_EQ(test, sx127X_get_loralna(t->map), -12);
+	sx127X_set_loralna(t->map, -100);
+	KUNIT_EXPECT_EQ(test, sx127X_get_loralna(t->map), -48);
+	sx127X_set_loralna(t->map, 6);
+	KUNIT_EXPECT_EQ(test, sx127X_get_loralna(t->map), 0);
+
+	/* The reserved gains 000 and 111 read as G1 and G6. */
+	t->regs[SX127X_REG_LNA] = 0x00;
+	KUNIT_EXPECT_EQ(test, sx127X_get_loralna(t->map), 0);
+	t->regs[SX127X_REG_LNA] = 0xE0;
+	KUNIT_EXPECT_EQ(test, sx127X_get_loralna(t->map), -48);
+}
+
+static void
+sx1278_test_lorabw(struct kunit *test)
+{
+	struct sx1278_test *t = test->priv;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(hz); i++) {
+		sx127X_set_lorabw(t->map, hz[i]);
+		KUNIT_EXPECT_EQ(test, sx127X_get_lorabw(t->map), hz[i]);
+	}
+
+	/* A bandwidth between the steps takes the next wider one. */
+	sx127X_set_lorabw(t->map, 100000);
+	KUNIT_EXPECT_EQ(test, sx127X_get_lorabw(t->map), 125000);
+	/* The reserved values above 500 kHz */
+	t->regs[SX127X_REG_MODEM_CONFIG1] = 0xF0;
+	KUNIT_EXPECT_EQ(test, sx127X_get_lorabw(t->map), 500000);
+
+	/* The 32 ms symbols of SF12 at 125 kHz mandate LDRO, 8 ms do not. */
+	sx127X_set_lorasprf(t->map, 4096);
+	sx127X_set_lorabw(t->map, 125000);
+	KUNIT_EXPECT_TRUE(test, t->regs[SX127X_REG_MODEM_CONFIG3] & 0x08);
+	sx127X_set_lorabw(t->map, 500000);
+	KUNIT_EXPECT_FALSE(test, t->regs[SX127X_REG_MODEM_CONFIG3] & 0x08);
+}
+
+static void
+sx1278_test_lorarxtimeout(struct kunit *test)
+{
+	static const u32 mss[] = { 5, 20, 100, 500 };
+	struct sx1278_test *t = test->priv;
+	u32 tsym;
+	u32 ms;
+	int i;
+
+	/* SF7 at 125 kHz */
+	sx127X_set_lorasprf(t->map, 128);
+	sx127X_set_lorabw(t->map, 125000);
+	tsym = DIV_ROUND_UP(128 * 1000, 125000);
+	for (i = 0; i < ARRAY_SIZE(mss); i++) {
+		sx127X_set_lorarxtimeout(t->map, mss[i]);
+		/* The time-out is whole symbols within a symbol below. */
+		ms = sx127X_get_lorarxtimeout(t->map);
+		KUNIT_EXPECT_LE(test, ms, mss[i]);
+		KUNIT_EXPECT_GE(test, ms + tsym, mss[i]);
+		/* The spreading factor shares the register. */
+		KUNIT_EXPECT_EQ(test, sx127X_get_lorasprf(t->map), 128);
+	}
+
+	/* 1 to 1023 symbols */
+	sx127X_set_lorarxtimeout(t->map, 0);
+	KUNIT_EXPECT_EQ(test, sx127X_get_lorarxbytetimeout(t->map), 1);
+
+	/* SF12 at 500 kHz, where ms * Hz comes near 32 bits */
+	sx127X_set_lorasprf(t->map, 4096);
+	sx127X_set_lorabw(t->map, 500000);
+	sx127X_set_lorarxtimeout(t->map, 8000);
+	KUNIT_EXPECT_EQ(test, sx127X_get_lorarxbytetimeout(t->map), 976);
+	KUNIT_EXPECT_EQ(test, sx127X_get_lorarxtimeout(t->map), 7995);
+	sx127X_set_lorarxtimeout(t->map, 60000);
+	KUNIT_EXPECT_EQ(test, sx127X_get_lorarxbytetimeout(t->map), 1023);
+}
+
+/*
+ * The state machine benchmarks run the polling passes on the SPI replay.  Each
+ * pass serves the listed transactions in order, so any other transaction of
+ * the state machine shows as a mismatch.  The replay's lookup takes the place
+ * of the SPI transfers in the measured time.
+ */
+
+#ifndef SX1278_TEST_PASSES
+#define SX1278_TEST_PASSES	10000
+#endif
+
+/* Unmatched entries after the passes, so a stray read never ends the replay */
+#define SX1278_TEST_PAD		(SX1278_RR_LOOKAHEAD + 1)
+
+struct sx1278_test_xact {
+	u8 addr;
+	u8 len;
+	const u8 *data;
+};
+
+/* A register or FIFO read with its values, and a register write */
+#define SX1278_TEST_RD(reg, ...) \
+	{ (reg), sizeof((const u8 []){ __VA_ARGS__ }), \
+	  (const u8 []){ __VA_ARGS__ } }
+#define SX1278_TEST_WR(reg) \
+	{ (reg) | SX127X_SPI_WRITE, 1, (const u8 []){ 0 } }
+
+/* Listening without anything on air */
+static const struct sx1278_test_xact sx1278_test_quiet[] = {
+	SX1278_TEST_RD(SX127X_REG_IRQ_FLAGS, 0x00),
+	SX1278_TEST_RD(SX127X_REG_OP_MODE, 0x80 | SX127X_RXSINGLE_MODE),
+};
+
+/* The single RX times out and is armed again. */
+static const struct sx1278_test_xact sx1278_test_rxtimeout[] = {
+	SX1278_TEST_RD(SX127X_REG_IRQ_FLAGS, SX127X_FLAG_RXTIMEOUT),
+	SX1278_TEST_RD(SX127X_REG_OP_MODE, 0x80 | SX127X_STANDBY_MODE),
+	SX1278_TEST_WR(SX127X_REG_IRQ_FLAGS),
+	SX1278_TEST_WR(SX127X_REG_OP_MODE),
+};
+
+/*
+ * A 20 bytes data frame to the short address 0x0002 of PAN 0x1234 is dropped
+ * by the filter after its header.
+ */
+static const struct sx1278_test_xact sx1278_test_filtered[] = {
+	SX1278_TEST_RD(SX127X_REG_IRQ_FLAGS, SX127X_FLAG_RXDONE),
+	SX1278_TEST_RD(SX127X_REG_OP_MODE, 0x80 | SX127X_STANDBY_MODE),
+	SX1278_TEST_RD(SX127X_REG_RX_NB_BYTES, 20),
+	SX1278_TEST_WR(SX127X_REG_FIFO_ADDR_PTR),
+	SX1278_TEST_RD(SX127X_REG_FIFO, 0x41, 0x88, 0x01, 0x34, 0x12, 0x02,
+		       0x00, 0x03, 0x00, 0xA0, 0xA1, 0xA2, 0xA3),
+	SX1278_TEST_WR(SX127X_REG_IRQ_FLAGS),
+	SX1278_TEST_WR(SX127X_REG_OP_MODE),
+};
+
+/**
+ * sx1278_test_phy - Build a PHY on the mock regmap and an empty SPI replay
+ * @test:	the test
+ *
+ * Return:	the PHY listening at SF7 and 125kHz
+ */
+static struct sx1278_phy *
+sx1278_test_phy(struct kunit *test)
+{
+	struct sx1278_test *t = test->priv;
+	struct ieee802154_hw *hw;
+	struct sx1278_phy *phy;
+	struct sx1278_rr *rr;
+
+	hw = kunit_kzalloc(test, sizeof(*hw), GFP_KERNEL);
+	phy = kunit_kzalloc(test, sizeof(*phy), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, hw);
+	KUNIT_ASSERT_NOT_NULL(test, phy);
+	phy->xfer = kunit_kzalloc(test, sizeof(*phy->xfer), GFP_KERNEL);
+	phy->rr = kunit_kzalloc(test, sizeof(*phy->rr), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, phy->xfer);
+	KUNIT_ASSERT_NOT_NULL(test, phy->rr);
+
+	hw->priv = phy;
+	phy->hw = hw;
+	phy->map = t->map;
+	spin_lock_init(&phy->req_lock);
+	init_waitqueue_head(&phy->req_wq);
+	rr = phy->rr;
+	spin_lock_init(&rr->lock);
+	init_waitqueue_head(&rr->wq);
+	mutex_init(&rr->replay_lock);
+	sx1278_xfer_init(phy->xfer, NULL);
+	phy->xfer->rr = rr;
+
+	phy->cfg.xosc = F_XOSC;
+	phy->pan_id = 0x1234;
+	phy->short_addr = 0x0001;
+	sx127X_set_lorasprf(t->map, 128);
+	sx127X_set_lorabw(t->map, 125000);
+	sx127X_get_loramod(t->map, &phy->mod);
+	atomic_set(&phy->state, SX1278_ST_RX_ARMED);
+
+	return phy;
+}
+
+/**
+ * sx1278_test_replay - Start the SPI replay of the transactions
+ * @test:	the test
+ * @phy:	the SX1278 PHY
+ * @xact:	the transactions of a pass
+ * @n:		the number of the transactions
+ * @passes:	the number of the passes
+ */
+static void
+sx1278_test_replay(struct kunit *test, struct sx1278_phy *phy,
+		   const struct sx1278_test_xact *xact, int n, int passes)
+{
+	struct sx1278_rr *rr = phy->rr;
+	size_t len = 0;
+	u8 *p;
+	int i, j;
+
+	for (j = 0; j < n; j++)
+		len += SX1278_RR_ENT_LEN + xact[j].len;
+	len = SX1278_RR_HDR_LEN + len * passes +
+	      SX1278_RR_ENT_LEN * SX1278_TEST_PAD;
+	rr->log = vzalloc(len);
+	KUNIT_ASSERT_NOT_NULL(test, rr->log);
+	memcpy(rr->log, SX1278_RR_MAGIC, 4);
+	put_unaligned_le32(SX1278_RR_VERSION, rr->log + 4);
+	p = rr->log + SX1278_RR_HDR_LEN;
+	for (i = 0; i < passes; i++) {
+		for (j = 0; j < n; j++) {
+			p[4] = xact[j].addr;
+			p[5] = xact[j].len;
+			memcpy(p + SX1278_RR_ENT_LEN, xact[j].data,
+			       xact[j].len);
+			p += SX1278_RR_ENT_LEN + xact[j].len;
+		}
+	}
+	for (i = 0; i < SX1278_TEST_PAD; i++, p += SX1278_RR_ENT_LEN)
+		p[4] = SX127X_MAX_REG + 1;
+	rr->log_len = len;
+	rr->pos = SX1278_RR_HDR_LEN;
+	rr->replaying = true;
+}
+
+/**
+ * sx1278_test_bench - Time the state machine's passes on the SPI replay
+ * @test:	the test
+ * @xact:	the transactions of a pass
+ * @n:		the number of the transactions
+ *
+ * Return:	the PHY after the passes
+ */
+static struct sx1278_phy *
+sx1278_test_bench(struct kunit *test, const struct sx1278_test_xact *xact,
+		  int n)
+{
+	struct sx1278_phy *phy;
+	struct sx1278_rr *rr;
+	ktime_t start;
+	s64 ns;
+	int i;
+
+	phy = sx1278_test_phy(test);
+	rr = phy->rr;
+	sx1278_test_replay(test, phy, xact, n, SX1278_TEST_PASSES);
+
+	start = ktime_get();
+	for (i = 0; i < SX1278_TEST_PASSES; i++) {
+		sx1278_ieee_poll(phy);
+		sx1278_ieee_statemachine(phy->hw);
+	}
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	KUNIT_EXPECT_EQ(test, rr->mismatched, 0);
+	KUNIT_EXPECT_EQ(test, rr->served, SX1278_TEST_PASSES * n);
+	/* The radio listens again after every pass. */
+	KUNIT_EXPECT_EQ(test, atomic_read(&phy->state) & SX1278_ST_OWNER,
+			SX1278_ST_RX_ARMED);
+	kunit_info(test, "%lld ns per pass\n",
+		   div_s64(ns, SX1278_TEST_PASSES));
+	sx1278_rr_free(rr);
+
+	return phy;
+}
+
+static void
+sx1278_test_bench_quiet(struct kunit *test)
+{
+	sx1278_test_bench(test, sx1278_test_quiet,
+			  ARRAY_SIZE(sx1278_test_quiet));
+}
+
+static void
+sx1278_test_bench_rxtimeout(struct kunit *test)
+{
+	sx1278_test_bench(test, sx1278_test_rxtimeout,
+			  ARRAY_SIZE(sx1278_test_rxtimeout));
+}
+
+static void
+sx1278_test_bench_filtered(struct kunit *test)
+{
+	struct sx1278_phy *phy;
+
+	phy = sx1278_test_bench(test, sx1278_test_filtered,
+				ARRAY_SIZE(sx1278_test_filtered));
+	KUNIT_EXPECT_EQ(test, phy->filtered, SX1278_TEST_PASSES);
+}
+
+/*
+ * The LQI and ED map the RSSI range from the default sensitivity of -148 dBm
+ * up to 0 dBm onto 0 to 255, in the high frequency band.
+ */
+static void
+sx1278_test_lqi(struct kunit *test)
+{
+	static const struct {
+		u8 rssi;	/* PKT_RSSI_VALUE */
+		s8 snr;		/* PKT_SNR_VALUE in 0.25 dB */
+		u8 lqi;
+	} cases[] = {
+		{ 255, 40, 255 },	/* Above 0 dBm, which wrapped to 0 */
+		{ 157, 40, 255 },	/* 0 dBm, the strongest */
+		{ 157, -40, 237 },	/* -10 dBm by the SNR correction */
+		{ 83, 40, 127 },	/* -74 dBm, the middle */
+		{ 9, 40, 0 },		/* -148 dBm, the weakest */
+		{ 0, -128, 0 },		/* Below the range, which went negative */
+	};
+	struct sx1278_test *t = test->priv;
+	struct sx1278_phy *phy;
+	int i;
+
+	phy = sx1278_test_phy(test);
+	t->regs[SX127X_REG_OP_MODE] &= ~0x08;
+	for (i = 0; i < ARRAY_SIZE(cases); i++) {
+		t->regs[SX127X_REG_PKT_RSSI_VALUE] = cases[i].rssi;
+		t->regs[SX127X_REG_PKT_SNR_VALUE] = cases[i].snr;
+		sx1278_ieee_rx_meta(phy, 20);
+		KUNIT_EXPECT_EQ(test, phy->rx_meta.lqi, cases[i].lqi);
+	}
+}
+
+static void
+sx1278_test_ed(struct kunit *test)
+{
+	static const struct {
+		u8 rssi;	/* RSSI_VALUE */
+		u8 level;
+	} cases[] = {
+		{ 255, 255 },	/* Above 0 dBm, which wrapped to 0 */
+		{ 157, 255 },	/* 0 dBm, the strongest */
+		{ 88, 127 },	/* -69 dBm, the middle */
+		{ 20, 1 },	/* -137 dBm */
+		{ 19, 0 },	/* -138 dBm, the weakest */
+		{ 0, 0 },	/* Below the range, which went negative */
+	};
+	struct sx1278_test *t = test->priv;
+	struct sx1278_phy *phy;
+	u8 level;
+	int i;
+
+	phy = sx1278_test_phy(test);
+	phy->opmode &= ~0x08;
+	for (i = 0; i < ARRAY_SIZE(cases); i++) {
+		t->regs[SX127X_REG_RSSI_VALUE] = cases[i].rssi;
+		KUNIT_EXPECT_EQ(test, sx1278_ieee_ed(phy->hw, &level), 0);
+		KUNIT_EXPECT_EQ(test, level, cases[i].level);
+	}
+}
+
+/*
+ * Two frames without ACK request go out in one burst.  The stack passes the
+ * second frame on the TX done of the first one, and its TX starts without the
+ * RX in between.  RX is armed again after the second TX done.
+ */
+static const struct sx1278_test_xact sx1278_test_burst_xact[] = {
+	SX1278_TEST_RD(SX127X_REG_IRQ_FLAGS, 0x00),
+	SX1278_TEST_RD(SX127X_REG_OP_MODE, 0x80 | SX127X_STANDBY_MODE),
+	SX1278_TEST_WR(SX127X_REG_FIFO_ADDR_PTR),
+	SX1278_TEST_WR(SX127X_REG_FIFO),
+	SX1278_TEST_WR(SX127X_REG_PAYLOAD_LENGTH),
+	SX1278_TEST_WR(SX127X_REG_OP_MODE),
+
+	SX1278_TEST_RD(SX127X_REG_IRQ_FLAGS, SX127X_FLAG_TXDONE),
+	SX1278_TEST_RD(SX127X_REG_OP_MODE, 0x80 | SX127X_STANDBY_MODE),
+	SX1278_TEST_WR(SX127X_REG_IRQ_FLAGS),
+	SX1278_TEST_WR(SX127X_REG_FIFO_ADDR_PTR),
+	SX1278_TEST_WR(SX127X_REG_FIFO),
+	SX1278_TEST_WR(SX127X_REG_PAYLOAD_LENGTH),
+	SX1278_TEST_WR(SX127X_REG_OP_MODE),
+
+	SX1278_TEST_RD(SX127X_REG_IRQ_FLAGS, SX127X_FLAG_TXDONE),
+	SX1278_TEST_RD(SX127X_REG_OP_MODE, 0x80 | SX127X_STANDBY_MODE),
+	SX1278_TEST_WR(SX127X_REG_IRQ_FLAGS),
+	SX1278_TEST_WR(SX127X_REG_OP_MODE),
+};
+
+/* The stack in place of mac802154, passing its next frame on completion */
+static void
+sx1278_test_xmit_done(struct ieee802154_hw *hw, struct sk_buff *skb)
+{
+	struct kunit *test = kunit_get_current_test();
+	struct sx1278_test *t = test->priv;
+	struct sk_buff *next = t->tx_next;
+
+	consume_skb(skb);
+	t->tx_done++;
+	t->tx_next = NULL;
+	if (next)
+		KUNIT_EXPECT_EQ(test, sx1278_ieee_xmit(hw, next), 0);
+}
+
+static void
+sx1278_test_burst(struct kunit *test)
+{
+	/* A data frame to the broadcast address without ACK request */
+	static const u8 frame[] = {
+		0x41, 0x88, 0x01, 0x34, 0x12, 0xFF, 0xFF, 0x01, 0x00,
+		0xA0, 0xA1, 0xA2, 0xA3,
+	};
+	struct sx1278_test *t = test->priv;
+	struct sx1278_phy *phy;
+	struct sk_buff *skb[2];
+	int i;
+
+	phy = sx1278_test_phy(test);
+	sx1278_test_replay(test, phy, sx1278_test_burst_xact,
+			   ARRAY_SIZE(sx1278_test_burst_xact), 1);
+	kunit_activate_static_stub(test, sx1278_ieee_xmit_done,
+				   sx1278_test_xmit_done);
+	for (i = 0; i < 2; i++) {
+		skb[i] = alloc_skb(sizeof(frame), GFP_KERNEL);
+		KUNIT_ASSERT_NOT_NULL(test, skb[i]);
+		skb_put_data(skb[i], frame, sizeof(frame));
+	}
+	atomic_set(&phy->state, SX1278_ST_IDLE);
+	KUNIT_ASSERT_EQ(test, sx1278_ieee_xmit(phy->hw, skb[0]), 0);
+	t->tx_next = skb[1];
+
+	/* The TX of the first frame */
+	sx1278_ieee_poll(phy);
+	sx1278_ieee_statemachine(phy->hw);
+	KUNIT_EXPECT_EQ(test, phy->opmode & 0x07, SX127X_TX_MODE);
+
+	/* The TX of the second frame right from the TX done */
+	sx1278_ieee_poll(phy);
+	sx1278_ieee_statemachine(phy->hw);
+	KUNIT_EXPECT_EQ(test, t->tx_done, 1);
+	KUNIT_EXPECT_PTR_EQ(test, READ_ONCE(phy->tx_buf), skb[1]);
+	KUNIT_EXPECT_EQ(test, phy->opmode & 0x07, SX127X_TX_MODE);
+	KUNIT_EXPECT_EQ(test, atomic_read(&phy->state) & SX1278_ST_OWNER,
+			SX1278_ST_TX_ACTIVE);
+	KUNIT_EXPECT_GT(test, phy->burst_us, 0);
+
+	/* The burst ends without a frame waiting. */
+	sx1278_ieee_poll(phy);
+	sx1278_ieee_statemachine(phy->hw);
+	KUNIT_EXPECT_EQ(test, t->tx_done, 2);
+	KUNIT_EXPECT_NULL(test, READ_ONCE(phy->tx_buf));
+	KUNIT_EXPECT_EQ(test, phy->burst_us, 0);
+	KUNIT_EXPECT_EQ(test, atomic_read(&phy->state) & SX1278_ST_OWNER,
+			SX1278_ST_RX_ARMED);
+
+	KUNIT_EXPECT_EQ(test, phy->rr->mismatched, 0);
+	KUNIT_EXPECT_EQ(test, phy->rr->served,
+			ARRAY_SIZE(sx1278_test_burst_xact));
+	sx1278_rr_free(phy->rr);
+}
+
+static struct kunit_case sx1278_test_cases[] = {
+	KUNIT_CASE(sx1278_test_lorafrq),
+	KUNIT_CASE(sx1278_test_lorafrf),
+	KUNIT_CASE(sx1278_test_lorapower),
+	KUNIT_CASE(sx1278_test_loralna),
+	KUNIT_CASE(sx1278_test_lorabw),
+	KUNIT_CASE(sx1278_test_lorarxtimeout),
+	KUNIT_CASE(sx1278_test_lqi),
+	KUNIT_CASE(sx1278_test_ed),
+	KUNIT_CASE(sx1278_test_bench_quiet),
+	KUNIT_CASE(sx1278_test_bench_rxtimeout),
+	KUNIT_CASE(sx1278_test_bench_filtered),
+	KUNIT_CASE(sx1278_test_burst),
+	{}
+};
+
+static struct kunit_suite sx1278_test_suite = {
+	.name = "sx1278",
+	.init = sx1278_test_init,
+	.test_cases = sx1278_test_cases,
+};
+kunit_test_suite(sx1278_test_suite);
@@ -0,0 +1,614 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include "lorafec.h"
+
+/* Symbol size and source symbols of a block by default */
+#define SYMBOL		64
+#define KMAX		16
+/* The acceptable probability of an unrecoverable block */
+#define TARGET		0.001
+/* The loss rate before the first report */
+#define LOSS		0.05
+/* Sending rounds after the first one, driven by the final reports */
+#define ROUNDS		4
+/* Waiting for the final report of a round in seconds */
+#define WAIT		5
+/* Object size at most */
+#define MAX_SIZE	(64 * 1024 * 1024)
+
+#define	BUFLEN		(FEC_HDR_LEN + 1024)
+
+struct addrinfo * have_addr(char *ipv6, char *port)
+{
+	struct addrinfo hints;
+	struct addrinfo *addr;
+	int status;
+
+	memset(&hints, 0, sizeof(struct addrinfo));
+	hints.ai_family = PF_INET6;
+	hints.ai_socktype = SOCK_DGRAM;
+
+	status = getaddrinfo(ipv6, port, &hints, &addr);
+	if (status) {
+		perror("getaddrinfo failed");
+		return NULL;
+	}
+	if (!addr) {
+		fprintf(stderr, "no interface with %s\n", ipv6);
+		return NULL;
+	}
+
+	return addr;
+}
+
+int have_bound_socket(char *ipv6, char *port)
+{
+	int s;
+	struct addrinfo *addr;
+	int yes = 1;
+
+	addr = have_addr(ipv6, port);
+	if (!addr)
+		return -1;
+
+	s = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+	if (bind(s, addr->ai_addr, addr->ai_addrlen)) {
+		perror("bind socket failed");
+		freeaddrinfo(addr);
+		return -1;
+	}
+
+	freeaddrinfo(addr);
+
+	return s;
+}
+
+void set_timeout(int s, int sec)
+{
+	struct timeval tv = { .tv_sec = sec };
+
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+/* The layout of an object in blocks of symbols */
+struct layout {
+	uint32_t size;
+	uint16_t symbol;
+	uint8_t kmax;
+	uint32_t n_blocks;
+};
+
+void have_layout(struct layout *l, uint32_t size, uint16_t symbol,
+		 uint8_t kmax)
+{
+	uint32_t n_syms = (size + symbol - 1) / symbol;
+
+	l->size = size;
+	l->symbol = symbol;
+	l->kmax = kmax;
+	/* An empty object still has one block with one symbol. */
+	if (!n_syms)
+		n_syms = 1;
+	l->n_blocks = (n_syms + kmax - 1) / kmax;
+}
+
+/* The source symbols of a block, the last one may be short of kmax. */
+int block_k(const struct layout *l, uint32_t block)
+{
+	uint32_t n_syms = (l->size + l->symbol - 1) / l->symbol;
+
+	if (!n_syms)
+		n_syms = 1;
+	if ((block + 1) * l->kmax <= n_syms)
+		return l->kmax;
+
+	return n_syms - block * l->kmax;
+}
+
+/*------------------------------- The Sender -------------------------------*/
+
+struct sender {
+	int s;
+	struct addrinfo *dst;
+	struct layout l;
+	uint8_t *obj;
+	uint8_t *next;		/* The next repair index of each block */
+	uint32_t object;
+	uint32_t seq;
+	unsigned int gap;	/* Between datagrams in ms */
+	double loss;
+	uint32_t received;	/* Of the latest report */
+	uint32_t expected;
+	struct fec_report rep;
+	int have_rep;
+};
+
+int send_symbol(struct sender *tx, uint32_t block, int index)
+{
+	const uint8_t *src[FEC_MAX_K];
+	uint8_t buf[BUFLEN];
+	struct fec_hdr hdr;
+	uint8_t *first;
+	int k = block_k(&tx->l, block);
+	int i;
+
+	hdr.type = FEC_DATA;
+	hdr.k = k;
+	hdr.index = index;
+	hdr.kmax = tx->l.kmax;
+	hdr.symbol = tx->l.symbol;
+	hdr.block = block;
+	hdr.object = tx->object;
+	hdr.size = tx->l.size;
+	hdr.seq = tx->seq++;
+	fec_put_hdr(buf, &hdr);
+
+	first = tx->obj + (size_t)block * tx->l.kmax * tx->l.symbol;
+	if (index < k) {
+		memcpy(buf + FEC_HDR_LEN, first + index * tx->l.symbol,
+		       tx->l.symbol);
+	} else {
+		for (i = 0; i < k; i++)
+			src[i] = first + i * tx->l.symbol;
+		fec_encode(src, k, index, buf + FEC_HDR_LEN, tx->l.symbol);
+	}
+
+	if (sendto(tx->s, buf, FEC_HDR_LEN + tx->l.symbol, 0,
+		   tx->dst->ai_addr, tx->dst->ai_addrlen) < 0) {
+		perror("send symbol failed");
+		return -1;
+	}
+	if (tx->gap)
+		usleep(tx->gap * 1000);
+
+	return 0;
+}
+
+void send_end(struct sender *tx)
+{
+	uint8_t buf[FEC_HDR_LEN];
+	struct fec_hdr hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.type = FEC_END;
+	hdr.k = block_k(&tx->l, 0);
+	hdr.kmax = tx->l.kmax;
+	hdr.symbol = tx->l.symbol;
+	hdr.object = tx->object;
+	hdr.size = tx->l.size;
+	hdr.seq = tx->seq;
+	fec_put_hdr(buf, &hdr);
+
+	if (sendto(tx->s, buf, FEC_HDR_LEN, 0,
+		   tx->dst->ai_addr, tx->dst->ai_addrlen) < 0)
+		perror("send end failed");
+}
+
+/*
+ * Take a report if there is one, and follow its loss rate.  Returns 0 for a
+ * report, -1 for nothing received and -2 for a datagram of something else.
+ */
+int recv_report(struct sender *tx, int flags)
+{
+	uint8_t buf[FEC_REPORT_LEN];
+	struct fec_report rep;
+	ssize_t len;
+
+	len = recv(tx->s, buf, sizeof(buf), flags);
+	if (len < 0)
+		return -1;
+	if (fec_get_report(buf, len, &rep) || rep.object != tx->object)
+		return -2;
+
+	if (rep.expected > tx->expected) {
+		fec_loss_update(&tx->loss, rep.received - tx->received,
+				rep.expected - tx->expected);
+		tx->received = rep.received;
+		tx->expected = rep.expected;
+	}
+	tx->rep = rep;
+	tx->have_rep = 1;
+
+	return 0;
+}
+
+int send_repairs(struct sender *tx, uint32_t block, int m)
+{
+	int k = block_k(&tx->l, block);
+
+	while (m-- > 0) {
+		if (send_symbol(tx, block, tx->next[block]))
+			return -1;
+		/* Out of repair indices, the earlier ones are sent again. */
+		if (tx->next[block] < FEC_MAX_INDEX)
+			tx->next[block]++;
+		else
+			tx->next[block] = k;
+	}
+
+	return 0;
+}
+
+int do_send(int argc, char *argv[])
+{
+	struct sender tx;
+	struct fec_need *need;
+	FILE *f;
+	long size;
+	uint32_t b;
+	int k, m, i, round;
+
+	if (argc < 5) {
+		printf("Usage: fecxfer send <src_addr> <dst_addr> <dst_port> <file> [symbol] [k] [gap_ms]\n");
+		return 0;
+	}
+
+	memset(&tx, 0, sizeof(tx));
+	tx.loss = LOSS;
+	tx.gap = (argc > 7) ? atoi(argv[7]) : 0;
+	i = (argc > 5) ? atoi(argv[5]) : SYMBOL;
+	k = (argc > 6) ? atoi(argv[6]) : KMAX;
+	if (i < 1 || i > BUFLEN - FEC_HDR_LEN || k < 1 || k > FEC_MAX_K) {
+		fprintf(stderr, "symbol is 1 to %d bytes, k is 1 to %d\n",
+			BUFLEN - FEC_HDR_LEN, FEC_MAX_K);
+		return -1;
+	}
+
+	f = fopen(argv[4], "rb");
+	if (!f) {
+		perror("open file failed");
+		return -1;
+	}
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	rewind(f);
+	if (size < 0 || size > MAX_SIZE) {
+		fprintf(stderr, "file is larger than %d bytes\n", MAX_SIZE);
+		fclose(f);
+		return -1;
+	}
+
+	have_layout(&tx.l, size, i, k);
+	if (tx.l.n_blocks > UINT16_MAX + 1) {
+		fprintf(stderr, "file has more than %d blocks\n", UINT16_MAX + 1);
+		fclose(f);
+		return -1;
+	}
+	/* Zero padding up to the full blocks */
+	tx.obj = calloc(tx.l.n_blocks, (size_t)k * i);
+	tx.next = malloc(tx.l.n_blocks);
+	if (!tx.obj || !tx.next || fread(tx.obj, 1, size, f) != (size_t)size) {
+		perror("read file failed");
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	for (b = 0; b < tx.l.n_blocks; b++)
+		tx.next[b] = block_k(&tx.l, b);
+
+	tx.s = have_bound_socket(argv[1], NULL);
+	if (tx.s < 0)
+		return tx.s;
+	tx.dst = have_addr(argv[2], argv[3]);
+	if (!tx.dst)
+		return -1;
+	srand(time(NULL) ^ getpid());
+	tx.object = rand();
+
+	printf("Send %s, %ld bytes in %u blocks of %d x %d bytes\n",
+	       argv[4], size, tx.l.n_blocks, k, i);
+
+	/* Source symbols and the repair symbols for the loss rate so far */
+	for (b = 0; b < tx.l.n_blocks; b++) {
+		k = block_k(&tx.l, b);
+		for (i = 0; i < k; i++) {
+			if (send_symbol(&tx, b, i))
+				return -1;
+			while (recv_report(&tx, MSG_DONTWAIT) != -1)
+				;
+		}
+		m = fec_repair_count(k, tx.loss, TARGET);
+		if (send_repairs(&tx, b, m))
+			return -1;
+		while (recv_report(&tx, MSG_DONTWAIT) != -1)
+			;
+	}
+
+	/* Fresh repair symbols for the blocks still short of symbols */
+	set_timeout(tx.s, WAIT);
+	for (round = 0; round <= ROUNDS; round++) {
+		tx.have_rep = 0;
+		send_end(&tx);
+		/* The report answering the end counts up to the end's sequence. */
+		while (recv_report(&tx, 0) != -1 && tx.rep.expected != tx.seq)
+			;
+		if (!tx.have_rep || tx.rep.expected != tx.seq) {
+			printf("No report of round %d\n", round);
+			continue;
+		}
+		printf("Round %d: %u of %u blocks, loss %.1f%%\n", round,
+		       tx.rep.done, tx.rep.blocks, tx.loss * 100);
+		if (tx.rep.done == tx.rep.blocks)
+			break;
+		if (round == ROUNDS)
+			break;
+
+		for (i = 0; i < tx.rep.n_needs; i++) {
+			need = &tx.rep.needs[i];
+			if (need->block >= tx.l.n_blocks)
+				continue;
+			m = need->count +
+			    fec_repair_count(need->count, tx.loss, TARGET);
+			if (send_repairs(&tx, need->block, m))
+				return -1;
+		}
+	}
+
+	printf("Sent %u datagrams\n", tx.seq);
+	freeaddrinfo(tx.dst);
+	free(tx.next);
+	free(tx.obj);
+	close(tx.s);
+
+	return (tx.have_rep && tx.rep.expected == tx.seq &&
+		tx.rep.done == tx.rep.blocks) ? 0 : 1;
+}
+
+/*------------------------------ The Receiver ------------------------------*/
+
+struct block {
+	uint8_t count;		/* Distinct symbols received */
+	uint8_t done;
+	uint8_t n_rep;
+	uint8_t seen[(FEC_MAX_INDEX + 1) / 8];
+	uint8_t rep_idx[FEC_MAX_K];
+	uint8_t *rep;		/* The repair symbols kept for decoding */
+};
+
+struct receiver {
+	int s;
+	struct layout l;
+	uint32_t object;
+	uint8_t *obj;
+	struct block *blocks;
+	uint32_t done;
+	uint32_t received;
+	uint32_t expected;
+	unsigned int report_every;
+	struct sockaddr_in6 peer;
+	socklen_t peer_len;
+};
+
+int start_object(struct receiver *rx, const struct fec_hdr *hdr)
+{
+	if (hdr->size > MAX_SIZE || hdr->symbol > BUFLEN - FEC_HDR_LEN)
+		return -1;
+
+	free(rx->obj);
+	if (rx->blocks) {
+		while (rx->l.n_blocks--)
+			free(rx->blocks[rx->l.n_blocks].rep);
+		free(rx->blocks);
+	}
+
+	have_layout(&rx->l, hdr->size, hdr->symbol, hdr->kmax);
+	rx->obj = calloc(rx->l.n_blocks, (size_t)hdr->kmax * hdr->symbol);
+	rx->blocks = calloc(rx->l.n_blocks, sizeof(*rx->blocks));
+	if (!rx->obj || !rx->blocks) {
+		perror("allocate object failed");
+		return -1;
+	}
+	rx->object = hdr->object;
+	rx->done = 0;
+	rx->received = 0;
+	rx->expected = 0;
+	printf("Recv object %08x, %u bytes in %u blocks of %u x %u bytes\n",
+	       hdr->object, hdr->size, rx->l.n_blocks, hdr->kmax, hdr->symbol);
+
+	return 0;
+}
+
+void decode_block(struct receiver *rx, uint32_t block)
+{
+	struct block *blk = &rx->blocks[block];
+	uint8_t *sym[FEC_MAX_K];
+	uint8_t idx[FEC_MAX_K];
+	uint8_t *first;
+	int k = block_k(&rx->l, block);
+	int i, j = 0;
+
+	first = rx->obj + (size_t)block * rx->l.kmax * rx->l.symbol;
+	for (i = 0; i < k; i++) {
+		sym[i] = first + i * rx->l.symbol;
+		idx[i] = i;
+		if (blk->seen[i / 8] & (1 << (i % 8)))
+			continue;
+		/* A repair symbol takes the place of the lost one. */
+		memcpy(sym[i], blk->rep + j * rx->l.symbol, rx->l.symbol);
+		idx[i] = blk->rep_idx[j++];
+	}
+
+	if (fec_decode(sym, idx, k, rx->l.symbol)) {
+		fprintf(stderr, "decode block %u failed\n", block);
+		return;
+	}
+	blk->done = 1;
+	free(blk->rep);
+	blk->rep = NULL;
+	rx->done++;
+}
+
+void take_symbol(struct receiver *rx, const struct fec_hdr *hdr,
+		 const uint8_t *data)
+{
+	struct block *blk;
+	int k;
+
+	if (hdr->block >= rx->l.n_blocks)
+		return;
+	k = block_k(&rx->l, hdr->block);
+	blk = &rx->blocks[hdr->block];
+	if (hdr->k != k || blk->done ||
+	    blk->seen[hdr->index / 8] & (1 << (hdr->index % 8)))
+		return;
+
+	if (hdr->index < k) {
+		memcpy(rx->obj + ((size_t)hdr->block * rx->l.kmax + hdr->index)
+				 * rx->l.symbol, data, rx->l.symbol);
+	} else {
+		if (!blk->rep)
+			blk->rep = malloc((size_t)k * rx->l.symbol);
+		if (!blk->rep)
+			return;
+		memcpy(blk->rep + blk->n_rep * rx->l.symbol, data,
+		       rx->l.symbol);
+		blk->rep_idx[blk->n_rep++] = hdr->index;
+	}
+	blk->seen[hdr->index / 8] |= 1 << (hdr->index % 8);
+
+	if (++blk->count == k)
+		decode_block(rx, hdr->block);
+}
+
+void send_report(struct receiver *rx)
+{
+	struct fec_report rep;
+	uint8_t buf[FEC_REPORT_LEN];
+	struct fec_need *need;
+	uint32_t b;
+	size_t len;
+
+	memset(&rep, 0, sizeof(rep));
+	rep.object = rx->object;
+	rep.received = rx->received;
+	rep.expected = rx->expected;
+	rep.done = rx->done;
+	rep.blocks = rx->l.n_blocks;
+	for (b = 0; b < rx->l.n_blocks && rep.n_needs < FEC_MAX_NEEDS; b++) {
+		if (rx->blocks[b].done)
+			continue;
+		need = &rep.needs[rep.n_needs++];
+		need->block = b;
+		need->count = block_k(&rx->l, b) - rx->blocks[b].count;
+	}
+
+	len = fec_put_report(buf, &rep);
+	if (sendto(rx->s, buf, len, 0, (struct sockaddr *)&rx->peer,
+		   rx->peer_len) < 0)
+		perror("send report failed");
+}
+
+int write_object(struct receiver *rx, char *path)
+{
+	FILE *f;
+	size_t len;
+
+	f = fopen(path, "wb");
+	if (!f) {
+		perror("open file failed");
+		return -1;
+	}
+	len = fwrite(rx->obj, 1, rx->l.size, f);
+	fclose(f);
+	if (len != rx->l.size) {
+		perror("write file failed");
+		return -1;
+	}
+	printf("Recv %u bytes into %s, loss %u of %u datagrams\n", rx->l.size,
+	       path, rx->expected - rx->received, rx->expected);
+
+	return 0;
+}
+
+int do_recv(int argc, char *argv[])
+{
+	struct receiver rx;
+	struct fec_hdr hdr;
+	uint8_t buf[BUFLEN];
+	ssize_t buflen;
+	int complete = 0;
+
+	if (argc < 4) {
+		printf("Usage: fecxfer recv <srv_addr> <srv_port> <file> [report_every]\n");
+		return 0;
+	}
+
+	memset(&rx, 0, sizeof(rx));
+	rx.report_every = (argc > 4) ? atoi(argv[4]) : 0;
+	rx.s = have_bound_socket(argv[1], argv[2]);
+	if (rx.s < 0)
+		return rx.s;
+
+	printf("Listening on %s UDP port %s\n", argv[1], argv[2]);
+	while (1) {
+		rx.peer_len = sizeof(rx.peer);
+		buflen = recvfrom(rx.s, buf, BUFLEN, 0,
+				  (struct sockaddr *)&rx.peer, &rx.peer_len);
+		if (buflen < 0) {
+			/* No more round after the object is complete */
+			if (complete)
+				break;
+			perror("receive from sender failed");
+			continue;
+		}
+		if (fec_get_hdr(buf, buflen, &hdr))
+			continue;
+		if (!rx.obj || hdr.object != rx.object) {
+			/* One object for each run */
+			if (complete || start_object(&rx, &hdr))
+				continue;
+		}
+
+		if (hdr.type == FEC_END) {
+			/* The lost datagrams at the end of the round count, too. */
+			if (hdr.seq > rx.expected)
+				rx.expected = hdr.seq;
+			send_report(&rx);
+			continue;
+		}
+
+		rx.received++;
+		if (hdr.seq >= rx.expected)
+			rx.expected = hdr.seq + 1;
+		take_symbol(&rx, &hdr, buf + FEC_HDR_LEN);
+
+		if (!complete && rx.done == rx.l.n_blocks) {
+			complete = 1;
+			if (write_object(&rx, argv[3]))
+				return -1;
+			send_report(&rx);
+			/* Answer the end of the round, which may lose the report. */
+			set_timeout(rx.s, 2 * WAIT);
+		} else if (rx.report_every &&
+			   !(rx.received % rx.report_every)) {
+			send_report(&rx);
+		}
+	}
+
+	close(rx.s);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	fec_init();
+
+	if (argc > 1 && !strcmp(argv[1], "send"))
+		return do_send(argc - 1, argv + 1);
+	if (argc > 1 && !strcmp(argv[1], "recv"))
+		return do_recv(argc - 1, argv + 1);
+
+	printf("Usage: fecxfer send|recv ...\n");
+
+	return 0;
+}
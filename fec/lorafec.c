@@ -0,0 +1,388 @@
+#include <stdlib.h>
+#include <string.h>
+#include "lorafec.h"
+
+/* GF(2^8) with the primitive polynomial x^8 + x^4 + x^3 + x^2 + 1 */
+#define GF_POLY		0x11D
+
+static uint8_t gf_exp[2 * 255];
+static uint8_t gf_log[256];
+
+/**
+ * fec_init - Build the GF(2^8) tables, before any other FEC function
+ */
+void fec_init(void)
+{
+	unsigned int x = 1;
+	int i;
+
+	for (i = 0; i < 255; i++) {
+		gf_exp[i] = x;
+		gf_exp[i + 255] = x;
+		gf_log[x] = i;
+		x <<= 1;
+		if (x & 0x100)
+			x ^= GF_POLY;
+	}
+}
+
+static uint8_t gf_mul(uint8_t a, uint8_t b)
+{
+	if (!a || !b)
+		return 0;
+
+	return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+static uint8_t gf_inv(uint8_t a)
+{
+	return gf_exp[255 - gf_log[a]];
+}
+
+/* dst += c * src */
+static void gf_addmul(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len)
+{
+	unsigned int lc;
+	size_t i;
+
+	if (!c)
+		return;
+
+	lc = gf_log[c];
+	for (i = 0; i < len; i++) {
+		if (src[i])
+			dst[i] ^= gf_exp[lc + gf_log[src[i]]];
+	}
+}
+
+/*
+ * The coefficient of source symbol i in repair symbol index.  The Cauchy
+ * matrix 1 / (x + y) with x = index >= k and y = i < k has no singular square
+ * submatrix, so any k distinct symbols are independent.
+ */
+static uint8_t fec_coef(int index, int i)
+{
+	return gf_inv(index ^ i);
+}
+
+/**
+ * fec_encode - Build a repair symbol of a block
+ * @src:	the k source symbols
+ * @k:		the number of source symbols
+ * @index:	the repair symbol's index from k to FEC_MAX_INDEX
+ * @repair:	the buffer of the repair symbol
+ * @len:	the symbol size in bytes
+ */
+void fec_encode(const uint8_t *const *src, int k, int index, uint8_t *repair,
+		size_t len)
+{
+	int i;
+
+	memset(repair, 0, len);
+	for (i = 0; i < k; i++)
+		gf_addmul(repair, src[i], fec_coef(index, i), len);
+}
+
+/* Invert the n x n matrix a into b by Gauss-Jordan elimination. */
+static int gf_invert(uint8_t *a, uint8_t *b, int n)
+{
+	int r, c, p;
+	uint8_t t;
+
+	memset(b, 0, n * n);
+	for (r = 0; r < n; r++)
+		b[r * n + r] = 1;
+
+	for (c = 0; c < n; c++) {
+		for (p = c; p < n && !a[p * n + c]; p++)
+			;
+		if (p == n)
+			return -1;
+		if (p != c) {
+			for (r = 0; r < n; r++) {
+				t = a[p * n + r];
+				a[p * n + r] = a[c * n + r];
+				a[c * n + r] = t;
+				t = b[p * n + r];
+				b[p * n + r] = b[c * n + r];
+				b[c * n + r] = t;
+			}
+		}
+
+		t = gf_inv(a[c * n + c]);
+		for (r = 0; r < n; r++) {
+			a[c * n + r] = gf_mul(a[c * n + r], t);
+			b[c * n + r] = gf_mul(b[c * n + r], t);
+		}
+
+		for (p = 0; p < n; p++) {
+			if (p == c || !a[p * n + c])
+				continue;
+			t = a[p * n + c];
+			gf_addmul(a + p * n, a + c * n, t, n);
+			gf_addmul(b + p * n, b + c * n, t, n);
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * fec_decode - Recover the lost source symbols of a block in place
+ * @sym:	k symbol buffers, sym[i] holds source symbol i or a repair symbol
+ * @idx:	the index of the symbol held in each buffer
+ * @k:		the number of source symbols
+ * @len:	the symbol size in bytes
+ *
+ * The buffers holding repair symbols are overwritten with the source symbols
+ * of their positions.
+ *
+ * Return:	0 / -1 for recovered / invalid or duplicated symbols
+ */
+int fec_decode(uint8_t **sym, const uint8_t *idx, int k, size_t len)
+{
+	int miss[FEC_MAX_K];
+	uint8_t seen[FEC_MAX_INDEX + 1];
+	uint8_t *a, *b, *tmp;
+	int e = 0;
+	int i, r, c;
+	int err = -1;
+
+	if (k < 1 || k > FEC_MAX_K)
+		return -1;
+
+	memset(seen, 0, sizeof(seen));
+	for (i = 0; i < k; i++) {
+		if (seen[idx[i]] || (idx[i] < k && idx[i] != i))
+			return -1;
+		seen[idx[i]] = 1;
+		if (idx[i] != i)
+			miss[e++] = i;
+	}
+	if (!e)
+		return 0;
+
+	a = malloc(2 * e * e + e * len);
+	if (!a)
+		return -1;
+	b = a + e * e;
+	tmp = b + e * e;
+
+	/* Take the received source symbols off the repair symbols. */
+	for (r = 0; r < e; r++) {
+		for (i = 0; i < k; i++) {
+			if (idx[i] == i)
+				gf_addmul(sym[miss[r]], sym[i],
+					  fec_coef(idx[miss[r]], i), len);
+		}
+	}
+
+	/* The rest is the Cauchy submatrix of the lost source symbols. */
+	for (r = 0; r < e; r++)
+		for (c = 0; c < e; c++)
+			a[r * e + c] = fec_coef(idx[miss[r]], miss[c]);
+	if (gf_invert(a, b, e))
+		goto fec_decode_err;
+
+	memset(tmp, 0, e * len);
+	for (c = 0; c < e; c++)
+		for (r = 0; r < e; r++)
+			gf_addmul(tmp + c * len, sym[miss[r]], b[c * e + r],
+				  len);
+	for (c = 0; c < e; c++)
+		memcpy(sym[miss[c]], tmp + c * len, len);
+	err = 0;
+
+fec_decode_err:
+	free(a);
+	return err;
+}
+
+/**
+ * fec_repair_count - Get the repair symbols for a block
+ * @k:		the number of source symbols
+ * @loss:	the datagram loss rate
+ * @target:	the acceptable probability of an unrecoverable block
+ *
+ * The losses are taken as independent, so the lost symbols of a block with k
+ * source and m repair symbols are binomial.  The smallest m with more than m
+ * losses less likely than @target is picked.
+ *
+ * Return:	the number of repair symbols
+ */
+int fec_repair_count(int k, double loss, double target)
+{
+	double pmf, cdf;
+	int n, m, x;
+
+	if (loss <= 0)
+		return 0;
+	if (loss >= 1)
+		return FEC_MAX_INDEX + 1 - k;
+
+	for (m = 0; k + m <= FEC_MAX_INDEX + 1; m++) {
+		n = k + m;
+		pmf = 1;
+		for (x = 0; x < n; x++)
+			pmf *= 1 - loss;
+		cdf = pmf;
+		for (x = 0; x < m; x++) {
+			pmf = pmf * (n - x) / (x + 1) * loss / (1 - loss);
+			cdf += pmf;
+		}
+		if (1 - cdf <= target)
+			return m;
+	}
+
+	return FEC_MAX_INDEX + 1 - k;
+}
+
+/**
+ * fec_loss_update - Update the smoothed loss rate with a report
+ * @rate:	the loss rate
+ * @received:	the datagrams received since the last report
+ * @expected:	the datagrams sent since the last report
+ */
+void fec_loss_update(double *rate, uint32_t received, uint32_t expected)
+{
+	double loss;
+
+	if (!expected || received > expected)
+		return;
+
+	loss = (double)(expected - received) / expected;
+	/* Move a quarter of the way, more for a larger sample. */
+	*rate += (loss - *rate) * (expected >= 64 ? 0.5 : 0.25);
+}
+
+static void put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+	put16(p, v >> 16);
+	put16(p + 2, v);
+}
+
+static uint16_t get16(const uint8_t *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+	return ((uint32_t)get16(p) << 16) | get16(p + 2);
+}
+
+/**
+ * fec_put_hdr - Write the header of a FEC_DATA or FEC_END datagram
+ * @buf:	FEC_HDR_LEN bytes at least
+ * @hdr:	the header
+ */
+void fec_put_hdr(uint8_t *buf, const struct fec_hdr *hdr)
+{
+	buf[0] = hdr->type;
+	buf[1] = hdr->k;
+	buf[2] = hdr->index;
+	buf[3] = hdr->kmax;
+	put16(buf + 4, hdr->symbol);
+	put16(buf + 6, hdr->block);
+	put32(buf + 8, hdr->object);
+	put32(buf + 12, hdr->size);
+	put32(buf + 16, hdr->seq);
+}
+
+/**
+ * fec_get_hdr - Read the header of a FEC_DATA or FEC_END datagram
+ * @buf:	the datagram
+ * @len:	the length of the datagram in bytes
+ * @hdr:	the header
+ *
+ * Return:	0 / -1 for valid / invalid header
+ */
+int fec_get_hdr(const uint8_t *buf, size_t len, struct fec_hdr *hdr)
+{
+	if (len < FEC_HDR_LEN)
+		return -1;
+
+	hdr->type = buf[0];
+	hdr->k = buf[1];
+	hdr->index = buf[2];
+	hdr->kmax = buf[3];
+	hdr->symbol = get16(buf + 4);
+	hdr->block = get16(buf + 6);
+	hdr->object = get32(buf + 8);
+	hdr->size = get32(buf + 12);
+	hdr->seq = get32(buf + 16);
+
+	if (hdr->type != FEC_DATA && hdr->type != FEC_END)
+		return -1;
+	if (!hdr->k || hdr->k > hdr->kmax || hdr->kmax > FEC_MAX_K ||
+	    !hdr->symbol)
+		return -1;
+	if (hdr->type == FEC_DATA && len != (size_t)FEC_HDR_LEN + hdr->symbol)
+		return -1;
+
+	return 0;
+}
+
+/**
+ * fec_put_report - Write a FEC_REPORT datagram
+ * @buf:	FEC_REPORT_LEN bytes at least
+ * @rep:	the report
+ *
+ * Return:	the length of the datagram in bytes
+ */
+size_t fec_put_report(uint8_t *buf, const struct fec_report *rep)
+{
+	uint8_t *p = buf + 18;
+	int i;
+
+	buf[0] = FEC_REPORT;
+	buf[1] = rep->n_needs;
+	put16(buf + 2, rep->done);
+	put16(buf + 4, rep->blocks);
+	put32(buf + 6, rep->object);
+	put32(buf + 10, rep->received);
+	put32(buf + 14, rep->expected);
+	for (i = 0; i < rep->n_needs; i++, p += 3) {
+		put16(p, rep->needs[i].block);
+		p[2] = rep->needs[i].count;
+	}
+
+	return p - buf;
+}
+
+/**
+ * fec_get_report - Read a FEC_REPORT datagram
+ * @buf:	the datagram
+ * @len:	the length of the datagram in bytes
+ * @rep:	the report
+ *
+ * Return:	0 / -1 for valid / invalid report
+ */
+int fec_get_report(const uint8_t *buf, size_t len, struct fec_report *rep)
+{
+	const uint8_t *p = buf + 18;
+	int i;
+
+	if (len < 18 || buf[0] != FEC_REPORT || buf[1] > FEC_MAX_NEEDS ||
+	    len != 18 + 3 * (size_t)buf[1])
+		return -1;
+
+	rep->n_needs = buf[1];
+	rep->done = get16(buf + 2);
+	rep->blocks = get16(buf + 4);
+	rep->object = get32(buf + 6);
+	rep->received = get32(buf + 10);
+	rep->expected = get32(buf + 14);
+	for (i = 0; i < rep->n_needs; i++, p += 3) {
+		rep->needs[i].block = get16(p);
+		rep->needs[i].count = p[2];
+	}
+
+	return 0;
+}
@@ -0,0 +1,73 @@
+#ifndef __LORAFEC_H__
+#define __LORAFEC_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Systematic erasure code over GF(2^8) across the datagrams of a block.  A
+ * block has k source symbols with index 0 to k - 1, and any number of repair
+ * symbols with index k to 255 built from a Cauchy matrix.  Any k distinct
+ * symbols of a block recover all of its source symbols.
+ */
+
+#define FEC_MAX_INDEX		255
+/* Source symbols in a block at most */
+#define FEC_MAX_K		128
+
+/* Datagram types */
+#define FEC_DATA		1	/* A source or repair symbol */
+#define FEC_END			2	/* The end of a sending round */
+#define FEC_REPORT		3	/* The receiver's loss report */
+
+/* Header of FEC_DATA and FEC_END datagrams in bytes */
+#define FEC_HDR_LEN		20
+
+struct fec_hdr {
+	uint8_t type;
+	uint8_t k;		/* Source symbols in this block */
+	uint8_t index;		/* < k for source, >= k for repair symbols */
+	uint8_t kmax;		/* Source symbols in a full block */
+	uint16_t symbol;	/* Symbol size in bytes */
+	uint16_t block;		/* Block number in the object */
+	uint32_t object;	/* Object ID */
+	uint32_t size;		/* Object size in bytes */
+	uint32_t seq;		/* Datagram sequence number of the sender */
+};
+
+/* The blocks still missing symbols in a report at most */
+#define FEC_MAX_NEEDS		32
+
+struct fec_need {
+	uint16_t block;
+	uint8_t count;		/* Symbols still needed by the block */
+};
+
+struct fec_report {
+	uint32_t object;
+	uint32_t received;	/* Datagrams received */
+	uint32_t expected;	/* Datagrams sent up to the latest received one */
+	uint16_t done;		/* Blocks recovered */
+	uint16_t blocks;	/* Blocks in the object */
+	uint8_t n_needs;
+	struct fec_need needs[FEC_MAX_NEEDS];
+};
+
+/* Report datagram in bytes at most */
+#define FEC_REPORT_LEN		(18 + 3 * FEC_MAX_NEEDS)
+
+void fec_init(void);
+
+void fec_encode(const uint8_t *const *src, int k, int index, uint8_t *repair,
+		size_t len);
+int fec_decode(uint8_t **sym, const uint8_t *idx, int k, size_t len);
+
+int fec_repair_count(int k, double loss, double target);
+void fec_loss_update(double *rate, uint32_t received, uint32_t expected);
+
+void fec_put_hdr(uint8_t *buf, const struct fec_hdr *hdr);
+int fec_get_hdr(const uint8_t *buf, size_t len, struct fec_hdr *hdr);
+size_t fec_put_report(uint8_t *buf, const struct fec_report *rep);
+int fec_get_report(const uint8_t *buf, size_t len, struct fec_report *rep);
+
+#endif
@@ -6,6 +6,13 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <sys/uio.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+
+#ifndef SO_TIMESTAMPING
+#define SO_TIMESTAMPING	37
+#endif
 
 void show_addr_info(struct sockaddr_in6 *addr)
 {
@@ -63,6 +70,36 @@ int have_bound_socket(char *ipv6, char *port)
 	return s;
 }
 
+void enable_timestamping(int s)
+{
+	int flags = SOF_TIMESTAMPING_RX_HARDWARE
+		    | SOF_TIMESTAMPING_RAW_HARDWARE
+		    | SOF_TIMESTAMPING_RX_SOFTWARE
+		    | SOF_TIMESTAMPING_SOFTWARE;
+
+	if (setsockopt(s, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)))
+		perror("enable SO_TIMESTAMPING failed");
+}
+
+void show_timestamps(struct msghdr *msg)
+{
+	struct cmsghdr *cmsg;
+	struct scm_timestamping *ts;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SO_TIMESTAMPING)
+			continue;
+
+		ts = (struct scm_timestamping *)CMSG_DATA(cmsg);
+		/* ts[0] is software, ts[2] is the raw hardware timestamp. */
+		printf("\tRX software timestamp %ld.%09ld\n",
+		       (long)ts->ts[0].tv_sec, ts->ts[0].tv_nsec);
+		printf("\tRX hardware timestamp %ld.%09ld\n",
+		       (long)ts->ts[2].tv_sec, ts->ts[2].tv_nsec);
+	}
+}
+
 int main(int argc, char *argv[])
 {
 	int srvsock;
@@ -73,6 +110,9 @@ int main(int argc, char *argv[])
 	char buf[BUFLEN];
 	ssize_t buflen;
 	int i;
+	struct iovec iov;
+	struct msghdr msg;
+	char ctrl[CMSG_SPACE(sizeof(struct scm_timestamping))];
 
 	if (argc < 3) {
 		printf("Usage: server <srv_addr> <srv_port>\n");
@@ -85,24 +125,34 @@ int main(int argc, char *argv[])
 	srvsock = have_bound_socket(srv_ip, srv_port);
 	if (srvsock < 0)
 		return srvsock;
+	enable_timestamping(srvsock);
 
 	printf("Server is started!!! Listening on %s UDP port %s\n",
 	       srv_ip, srv_port);
 	while (1) {
 		/* Prepare and receive from client. */
 		memset(buf, 0, BUFLEN);
-		addrlen = sizeof(cli_addr);
-		buflen = recvfrom(srvsock, buf, BUFLEN, 0,
-				  (struct sockaddr *)&cli_addr, &addrlen);
+		iov.iov_base = buf;
+		iov.iov_len = BUFLEN;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_name = &cli_addr;
+		msg.msg_namelen = sizeof(cli_addr);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = ctrl;
+		msg.msg_controllen = sizeof(ctrl);
+		buflen = recvmsg(srvsock, &msg, 0);
 		if (buflen < 0) {
 			perror("receive from client failed");
 			continue;
 		}
+		addrlen = msg.msg_namelen;
 		
 		/* Show client's information. */
 		printf("Client ");
 		show_addr_info(&cli_addr);
 		printf("\tRecv %s with in %zd bytes\n", buf, buflen);
+		show_timestamps(&msg);
 
 		/* Uppercase received characters in buffer. */
 		for (i = 0; buf[i] != 0; i++)